@@ -0,0 +1,46 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "util.h"
+#include "cc.h"
+
+/*
+Scan a file several times, without preprocessing it, and print the
+best time per byte.
+*/
+int
+main(int argc, char *argv[])
+{
+	struct token t;
+	FILE *file;
+	clock_t start, best;
+	long size;
+	int runs, i;
+
+	argv0 = argv[0];
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s file [runs]\n", argv0);
+		return 2;
+	}
+	runs = argc == 3 ? atoi(argv[2]) : 5;
+	best = -1;
+	for (i = 0; i < runs; ++i) {
+		file = fopen(argv[1], "r");
+		if (!file)
+			fatal("open %s:", argv[1]);
+		start = clock();
+		scanfrom(argv[1], file);
+		do scan(&t);
+		while (t.kind != TEOF);
+		scanclose();
+		start = clock() - start;
+		if (best == (clock_t)-1 || start < best)
+			best = start;
+	}
+	file = fopen(argv[1], "r");
+	if (!file || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0)
+		fatal("size of %s:", argv[1]);
+	printf("%ld bytes, %.3f s, %.2f ns/byte\n", size, (double)best / CLOCKS_PER_SEC, (double)best / CLOCKS_PER_SEC * 1e9 / size);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Build bench/scan.c with the compiler sources and time the scanner on
+# generated input made of the runs it skips in bulk: comment bodies,
+# indentation, and identifiers.
+#
+# usage: bench/scan.sh [lines] [runs]
+
+: ${CC:=cc}
+: ${CFLAGS:=-O2}
+
+lines=${1:-200000}
+runs=${2:-5}
+dir=$(mktemp -d)
+trap 'rm -r "$dir"' EXIT
+
+set --
+for src in *.c ; do
+	case $src in
+	main.c|driver.c|cache.c) ;;
+	*) set -- "$@" "$src" ;;
+	esac
+done
+$CC $CFLAGS -I. -o "$dir/scan" bench/scan.c "$@" || exit
+
+awk -v n="$lines" 'BEGIN {
+	for (i = 0; i < n; ++i) {
+		if (i % 4 == 0) {
+			print "/*"
+			print " * Permission is hereby granted, free of charge, to any person obtaining a"
+			print " * copy of this software and associated documentation files, to deal in"
+			print " */"
+		}
+		printf "\t\tint identifier_%d;  // a trailing line comment about it\n", i % 100
+	}
+}' >"$dir/input.c"
+
+"$dir/scan" "$dir/input.c" "$runs"
@@ -0,0 +1,356 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "cache.h"
+
+/* temporary files older than this are left over from an interrupted build */
+#define STALETMP (24 * 60 * 60)
+
+struct entry {
+	char *path;
+	time_t mtime;
+	unsigned long long size;
+};
+
+static const char *cachedir;
+static unsigned long long cachesize;
+/*
+Estimated size of the objects in the cache, counted by the last
+eviction and increased by each insertion since. Builds running
+concurrently may insert more, which is only noticed by the next
+eviction.
+*/
+static unsigned long long cacheused;
+static bool cachecounted;
+
+/* SHA-256 */
+
+#define ROR(x, n) (((x) >> (n) | (x) << (32 - (n))) & 0xffffffff)
+
+static const uint_least32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+hashblock(struct hash *h, const unsigned char *buf)
+{
+	uint_least32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint_least32_t)buf[4 * i] << 24 | buf[4 * i + 1] << 16 | buf[4 * i + 2] << 8 | buf[4 * i + 3];
+	for (; i < 64; ++i) {
+		t1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10;
+		t2 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3;
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16] & 0xffffffff;
+	}
+	memcpy(s, h->state, sizeof(s));
+	for (i = 0; i < 64; ++i) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) + (s[4] & s[5] ^ ~s[4] & s[6]) + k[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) + (s[0] & s[1] ^ s[0] & s[2] ^ s[1] & s[2]);
+		memmove(s + 1, s, 7 * sizeof(s[0]));
+		s[4] = s[4] + t1 & 0xffffffff;
+		s[0] = t1 + t2 & 0xffffffff;
+	}
+	for (i = 0; i < 8; ++i)
+		h->state[i] = h->state[i] + s[i] & 0xffffffff;
+}
+
+void
+hashinit(struct hash *h)
+{
+	static const uint_least32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(h->state, init, sizeof(init));
+	h->len = 0;
+}
+
+void
+hashupdate(struct hash *h, const void *ptr, size_t len)
+{
+	const unsigned char *pos = ptr;
+	size_t n, off;
+
+	off = h->len % 64;
+	h->len += len;
+	if (off) {
+		n = 64 - off;
+		if (n > len)
+			n = len;
+		memcpy(h->buf + off, pos, n);
+		pos += n, len -= n;
+		if (off + n < 64)
+			return;
+		hashblock(h, h->buf);
+	}
+	for (; len >= 64; pos += 64, len -= 64)
+		hashblock(h, pos);
+	memcpy(h->buf, pos, len);
+}
+
+void
+hashfile(struct hash *h, const char *name)
+{
+	char buf[16384];
+	ssize_t ret;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		fatal("open %s:", name);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		hashupdate(h, buf, ret);
+	if (ret < 0)
+		fatal("read %s:", name);
+	close(fd);
+}
+
+void
+hashfinal(struct hash *h, char str[65])
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char pad[72];
+	size_t n;
+	int i;
+
+	n = 64 - (h->len + 8) % 64;
+	if (n == 0)
+		n = 64;
+	memset(pad, 0, n);
+	pad[0] = 0x80;
+	for (i = 0; i < 8; ++i)
+		pad[n + i] = h->len * 8 >> 56 - 8 * i & 0xff;
+	hashupdate(h, pad, n + 8);
+	for (i = 0; i < 32; ++i) {
+		n = h->state[i / 4] >> 24 - i % 4 * 8 & 0xff;
+		str[2 * i] = hex[n >> 4];
+		str[2 * i + 1] = hex[n & 0xf];
+	}
+	str[64] = '\0';
+}
+
+/* object cache */
+
+static char *
+cachepath(const char *name, const char *ext)
+{
+	char *path;
+	size_t dirlen, namelen, extlen;
+
+	dirlen = strlen(cachedir);
+	namelen = strlen(name);
+	extlen = strlen(ext);
+	path = xmalloc(dirlen + namelen + extlen + 2);
+	memcpy(path, cachedir, dirlen);
+	path[dirlen] = '/';
+	memcpy(path + dirlen + 1, name, namelen);
+	memcpy(path + dirlen + 1 + namelen, ext, extlen + 1);
+	return path;
+}
+
+static bool
+copyfile(int src, int dst)
+{
+	char buf[16384], *pos;
+	ssize_t n, ret;
+
+	while ((n = read(src, buf, sizeof(buf))) > 0) {
+		for (pos = buf; n > 0; pos += ret, n -= ret) {
+			ret = write(dst, pos, n);
+			if (ret < 0)
+				return false;
+		}
+	}
+	return n == 0;
+}
+
+static int
+entrycmp(const void *p1, const void *p2)
+{
+	const struct entry *e1 = p1, *e2 = p2;
+
+	return (e1->mtime > e2->mtime) - (e1->mtime < e2->mtime);
+}
+
+/* remove the least recently used objects until the cache is within its size limit */
+static void
+evict(void)
+{
+	struct array entries = {0};
+	struct entry *e;
+	struct dirent *d;
+	struct stat st;
+	unsigned long long total;
+	const char *dot;
+	char *path;
+	time_t now;
+	DIR *dir;
+
+	dir = opendir(cachedir);
+	if (!dir)
+		return;
+	now = time(NULL);
+	total = 0;
+	while ((d = readdir(dir))) {
+		dot = strrchr(d->d_name, '.');
+		if (!dot || d->d_name[0] == '.')
+			continue;
+		path = cachepath(d->d_name, "");
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (strncmp(d->d_name, "tmp.", 4) == 0) {
+			if (now - st.st_mtime > STALETMP)
+				unlink(path);
+			free(path);
+			continue;
+		}
+		if (strcmp(dot, ".o") != 0) {
+			free(path);
+			continue;
+		}
+		e = arrayadd(&entries, sizeof(*e));
+		e->path = path;
+		e->mtime = st.st_mtime;
+		e->size = st.st_size;
+		total += e->size;
+	}
+	closedir(dir);
+	if (total > cachesize) {
+		qsort(entries.val, entries.len / sizeof(*e), sizeof(*e), entrycmp);
+		/* leave some room so that we don't evict on every insertion */
+		arrayforeach (&entries, e) {
+			if (total <= cachesize / 10 * 9)
+				break;
+			if (unlink(e->path) == 0 || errno == ENOENT)
+				total -= e->size;
+		}
+	}
+	arrayforeach (&entries, e)
+		free(e->path);
+	free(entries.val);
+	cacheused = total;
+	cachecounted = true;
+}
+
+void
+cacheinit(const char *dir, unsigned long long size)
+{
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		fatal("mkdir %s:", dir);
+	cachedir = dir;
+	cachesize = size;
+}
+
+/* create an empty temporary file in the cache directory */
+char *
+cachetemp(void)
+{
+	char *path;
+	int fd;
+
+	path = cachepath("tmp.XXXXXX", "");
+	fd = mkstemp(path);
+	if (fd < 0)
+		fatal("mkstemp:");
+	close(fd);
+	return path;
+}
+
+/* copy the cached object for key to output, if there is one */
+bool
+cacheget(const char *key, const char *output)
+{
+	char *path;
+	int src, dst;
+	bool ret;
+
+	path = cachepath(key, ".o");
+	src = open(path, O_RDONLY);
+	free(path);
+	if (src < 0)
+		return false;
+	dst = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (dst < 0) {
+		close(src);
+		return false;
+	}
+	ret = copyfile(src, dst);
+	if (close(dst) < 0)
+		ret = false;
+	/* mark the entry as recently used */
+	if (ret)
+		futimens(src, NULL);
+	close(src);
+	return ret;
+}
+
+/* insert the object output into the cache under key */
+void
+cacheput(const char *key, const char *output)
+{
+	char *tmp, *path;
+	int src, dst;
+	mode_t mask;
+	struct stat st;
+	bool ret;
+
+	src = open(output, O_RDONLY);
+	if (src < 0) {
+		warn("open %s:", output);
+		return;
+	}
+	/* write to a temporary file and rename it into place, so
+	 * that concurrent builds never see a partial object */
+	tmp = cachepath("tmp.XXXXXX", "");
+	dst = mkstemp(tmp);
+	if (dst < 0) {
+		warn("mkstemp:");
+		close(src);
+		free(tmp);
+		return;
+	}
+	/* mkstemp creates the file with mode 0600, but the cache may be shared */
+	mask = umask(0);
+	umask(mask);
+	fchmod(dst, 0666 & ~mask);
+	ret = copyfile(src, dst);
+	close(src);
+	if (ret && fstat(dst, &st) == 0)
+		cacheused += st.st_size;
+	if (close(dst) < 0)
+		ret = false;
+	path = cachepath(key, ".o");
+	if (!ret || rename(tmp, path) < 0) {
+		warn("cache %s:", output);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+	/* scanning the cache is expensive, so only do it when it may have grown too large */
+	if (!cachecounted || cacheused > cachesize)
+		evict();
+}
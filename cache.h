@@ -0,0 +1,15 @@
+struct hash {
+	uint_least32_t state[8];
+	unsigned char buf[64];
+	unsigned long long len;
+};
+
+void hashinit(struct hash *);
+void hashupdate(struct hash *, const void *, size_t);
+void hashfile(struct hash *, const char *);
+void hashfinal(struct hash *, char [65]);
+
+void cacheinit(const char *, unsigned long long);
+char *cachetemp(void);
+bool cacheget(const char *, const char *);
+void cacheput(const char *, const char *);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 struct func;
+struct pch;
 
 enum tokenkind {
 	TNONE,
@@ -292,9 +293,29 @@ struct decl {
 	} u;
 };
 
+/* an identifier or tag declared in a scope */
+struct binding {
+	const char *name;
+	union {
+		struct decl *decl;
+		struct type *tag;
+	} u;
+	/* the scope it was declared in, and that scope's depth */
+	struct scope *scope;
+	int depth;
+	/* the binding of the same name that it hides, and the start of that list */
+	struct binding *shadow, **head;
+	/* the binding declared before it in the same scope */
+	struct binding *next;
+};
+
 struct scope {
-	struct map tags;
-	struct map decls;
+	/* the bindings declared in this scope, most recent first */
+	struct binding *tags;
+	struct binding *decls;
+	int depth;
+	/* a function parameter scope waiting to be re-opened for the body */
+	bool hidden;
 	struct block *breaklabel;
 	struct block *continuelabel;
 	struct switchcases *switchcases;
@@ -402,6 +423,7 @@ extern struct token tok;
 extern const char *tokstr[];
 
 void tokenprint(const struct token *);
+void tokenflush(void);
 char *tokencheck(const struct token *, enum tokenkind, const char *);
 void error(const struct location *, const char *, ...);
 
@@ -409,7 +431,13 @@ void error(const struct location *, const char *, ...);
 
 void scanfrom(const char *, FILE *);
 void scanopen(void);
+void scaninclude(const char *, FILE *);
+void scanbuf(const char *, const char *, size_t);
+void scanclose(void);
+const char *scanpath(void);
+char *scanheadername(void);
 void scansetloc(struct location loc);
+void scanskip(void);
 void scan(struct token *);
 
 /* preprocessor */
@@ -417,11 +445,31 @@ void scan(struct token *);
 enum ppflags {
 	/* preserve newlines in preprocessor output */
 	PPNEWLINE   = 1 << 0,
+	/* collect statistics about macro expansion */
+	PPSTATS     = 1 << 1,
+};
+
+/* include directory lists, in search order */
+enum incdir {
+	INCQUOTE,   /* -iquote, only for #include "..." */
+	INCUSER,    /* -I */
+	INCSYSTEM,  /* -isystem */
+	INCAFTER,   /* -idirafter */
 };
 
 extern enum ppflags ppflags;
 
 void ppinit(void);
+void ppreset(void);
+void ppincdir(enum incdir, char *);
+void ppdefine(const char *);
+void ppundef(const char *);
+void ppinclude(const char *);
+size_t ppsave(struct pch *);
+void ppload(void *, const char *);
+void ppstats(size_t, bool);
+unsigned char *ppembed(size_t *);
+void ppembedskip(size_t);
 
 void next(void);
 bool peek(int);
@@ -463,6 +511,8 @@ struct target {
 	struct type *typevalist;
 	struct type *typewchar;
 	int signedchar;
+	/* predefined macros naming the architecture, as "name value" */
+	const char *const *macros;
 };
 
 extern const struct target *targ;
@@ -495,10 +545,14 @@ struct type *typename(struct scope *, enum typequal *, struct expr **);
 struct decl *stringdecl(struct expr *);
 
 void emittentativedefns(void);
+void declreset(void);
+size_t declsave(struct pch *);
+void declload(void *);
 
 /* scope */
 
 void scopeinit(void);
+void scopereset(void);
 struct scope *mkscope(struct scope *);
 struct scope *delscope(struct scope *);
 
@@ -512,6 +566,7 @@ extern struct scope filescope;
 
 /* expr */
 
+unsigned long charvalue(const char *, struct type **, struct location *);
 struct type *stringconcat(struct stringlit *, bool);
 
 struct expr *expr(struct scope *);
@@ -520,6 +575,7 @@ struct expr *condexpr(struct scope *);
 unsigned long long intconstexpr(struct scope *, bool);
 void delexpr(struct expr *);
 
+struct expr *embedexpr(struct type *, unsigned char *, size_t);
 struct expr *exprassign(struct expr *, struct type *);
 struct expr *exprpromote(struct expr *);
 
@@ -536,8 +592,66 @@ struct init *parseinit(struct scope *, struct type *);
 
 void stmt(struct func *, struct scope *);
 
+/* server */
+
+void serve(const char *);
+
+/* pch */
+
+void pchcreate(void);
+void pchsave(const char *);
+void pchload(const char *);
+
+void *pchat(struct pch *, size_t);
+size_t pchobj(struct pch *, const void *, size_t, bool *);
+void pchptr(struct pch *, size_t, size_t);
+void pchstr(struct pch *, size_t, const char *);
+void pchident(struct pch *, size_t, const char *);
+void pchtype(struct pch *, size_t, struct type *);
+void pchdecl(struct pch *, size_t, struct decl *);
+void pchfile(struct pch *, const char *);
+
+/* token cache */
+
+/* directory of the token cache, or NULL if it is not used */
+extern const char *tokcachedir;
+
+const void *tokcacheget(const char *, const void *, size_t, size_t *);
+void tokcacheput(const char *, const void *, size_t, const void *, size_t);
+
+/* include report */
+
+enum reportkind {
+	REPORTTOKENS,
+	REPORTDECLS,
+	REPORTFUNCS,
+	REPORTBYTES,
+	NREPORT,
+};
+
+/* how the file being scanned changes */
+enum reportmove {
+	REPORTSWITCH,  /* replace the current file */
+	REPORTENTER,   /* include the file from the current file */
+	REPORTLEAVE,   /* return to the file including the current file */
+};
+
+/* whether to report the cost of each source file of the translation unit */
+extern bool includereport;
+
+void reportfile(const char *, enum reportmove);
+void reportadd(enum reportkind, unsigned long long);
+void reportbegin(void);
+void reportend(void);
+void reportprint(void);
+
 /* backend */
 
+/* check the input without building or emitting functions */
+extern bool syntaxonly;
+/* emit only the definitions reachable from the roots, once all translation units are seen */
+extern bool wholeprogram;
+
 struct gotolabel {
 	struct block *label;
 	bool defined;
@@ -572,3 +686,9 @@ void funcinit(struct func *, struct decl *, struct init *, bool);
 
 void emitfunc(struct func *, bool);
 void emitdata(struct decl *,  struct init *);
+void emitreset(void);
+void emitroot(char *);
+void emitprogram(void);
+size_t emitsave(struct pch *);
+void emitload(void *);
+void emitsavevalue(struct pch *, size_t, struct value *);
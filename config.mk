@@ -0,0 +1,5 @@
+PREFIX=/usr/local
+BINDIR=$(PREFIX)/bin
+CC=cc
+CFLAGS=-std=c99 -Wall -Wpedantic -Wno-parentheses -Wno-switch -g -pipe
+LDFLAGS=
@@ -9,6 +9,8 @@
 #include "cc.h"
 
 static struct decl *tentativedefns, **tentativedefnsend = &tentativedefns;
+/* string literal objects, keyed by their contents */
+static struct map strings;
 
 struct qualtype {
 	struct type *type;
@@ -619,6 +621,7 @@ declaratortypes(struct scope *s, struct list *result, char **name, struct scope
 			if (funcscope && ptr->prev == prev) {
 				/* we may need to re-open the scope later if this is a function definition */
 				*funcscope = s;
+				s->hidden = true;
 				s = s->parent;
 			} else {
 				s = delscope(s);
@@ -1033,6 +1036,8 @@ decl(struct scope *s, struct func *f)
 		prior = scopegetdecl(s, name, false);
 		if (prior && prior->kind != kind)
 			error(&tok.loc, "'%s' redeclared with different kind", name);
+		if (includereport)
+			reportadd(REPORTDECLS, 1);
 		switch (kind) {
 		case DECLTYPE:
 			if (align)
@@ -1043,6 +1048,8 @@ decl(struct scope *s, struct func *f)
 				scopeputdecl(s, mkdecl(name, DECLTYPE, t, tq, LINKNONE));
 			else if (!typesame(prior->type, t) || prior->qual != tq)
 				error(&tok.loc, "typedef '%s' redefined with different type", name);
+			if (funcscope)
+				delscope(funcscope);
 			break;
 		case DECLOBJECT:
 			if (align && align < t->align)
@@ -1099,6 +1106,9 @@ decl(struct scope *s, struct func *f)
 				/* re-open scope from function declarator */
 				assert(funcscope);
 				s = funcscope;
+				s->hidden = false;
+				if (includereport)
+					reportadd(REPORTFUNCS, 1);
 				f = mkfunc(d, name, t, s);
 				stmt(f, s);
 				if (d->u.func.isnoreturn)
@@ -1125,7 +1135,6 @@ decl(struct scope *s, struct func *f)
 struct decl *
 stringdecl(struct expr *expr)
 {
-	static struct map strings;
 	struct mapkey key;
 	void **entry;
 	struct decl *d;
@@ -1155,3 +1164,63 @@ emittentativedefns(void)
 			defineobj(d, NULL, false, NULL);
 	}
 }
+
+void
+declreset(void)
+{
+	tentativedefns = NULL;
+	tentativedefnsend = &tentativedefns;
+	if (strings.len)
+		mapfree(&strings, NULL);
+	strings.len = 0;
+}
+
+/* the pending tentative definitions and string literal objects, for a precompiled header */
+struct declstate {
+	struct decl *tentativedefns;
+	struct stringdecl {
+		void *data;
+		size_t size;
+		struct decl *decl;
+	} *strings;
+	size_t nstrings;
+};
+
+size_t
+declsave(struct pch *p)
+{
+	size_t off, slot, i;
+
+	off = pchobj(p, NULL, sizeof(struct declstate), NULL);
+	pchdecl(p, off + offsetof(struct declstate, tentativedefns), tentativedefns);
+	slot = pchobj(p, NULL, strings.len * sizeof(struct stringdecl), NULL);
+	pchptr(p, off + offsetof(struct declstate, strings), slot);
+	((struct declstate *)pchat(p, off))->nstrings = strings.len;
+	for (i = 0; strings.len && i < strings.cap; ++i) {
+		if (!strings.keys[i].str)
+			continue;
+		pchptr(p, slot + offsetof(struct stringdecl, data), pchobj(p, strings.keys[i].str, strings.keys[i].len, NULL));
+		((struct stringdecl *)pchat(p, slot))->size = strings.keys[i].len;
+		pchdecl(p, slot + offsetof(struct stringdecl, decl), strings.vals[i]);
+		slot += sizeof(struct stringdecl);
+	}
+	return off;
+}
+
+void
+declload(void *state)
+{
+	struct declstate *st = state;
+	struct stringdecl *s;
+	struct mapkey key;
+
+	tentativedefns = st->tentativedefns;
+	for (tentativedefnsend = &tentativedefns; *tentativedefnsend; tentativedefnsend = &(*tentativedefnsend)->next)
+		;
+	for (s = st->strings; s < st->strings + st->nstrings; ++s) {
+		if (!strings.len)
+			mapinit(&strings, 64);
+		mapkey(&key, s->data, s->size);
+		*mapput(&strings, &key) = s->decl;
+	}
+}
@@ -6,15 +6,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "util.h"
+#include "cache.h"
 
 enum filetype {
 	NONE,   /* detect based on file extension */
@@ -37,23 +44,84 @@ enum stage {
 
 #include "config.h"
 
+/* default maximum size of the object cache */
+#define DEFCACHESIZE (1ull << 30)
+/* maximum number of translation units compiled by one cproc-qbe process */
+#define BATCHMAX 32
+/* milliseconds between checks for exited processes while waiting for a jobserver token */
+#define JOBSERVERPOLL 10
+
 struct stageinfo {
 	const char *name;
 	struct array cmd;
 	size_t cmdbase;
-	pid_t pid;
+};
+
+struct stagetime {
+	bool done;
+	struct timespec start;
+	double real, user, sys;
+	long maxrss;  /* in KiB */
 };
 
 struct input {
-	char *name;
+	char *name, *src;
 	unsigned stages;
 	enum filetype filetype;
 	bool lib;
+	/* name refers to an anonymous in-memory file held open by the driver */
+	bool memfd;
+	/* resource usage of each stage, for -time */
+	struct stagetime time[LINK];
+};
+
+/* an intermediate file, closed or unlinked by removetemps */
+struct temp {
+	char *path;
+	/* descriptor of an in-memory file, or -1 */
+	int fd;
+};
+
+/* a running per-input pipeline */
+struct job {
+	struct input *input;
+	char *name, *output;
+	/* preprocessed source awaiting a cache lookup */
+	char *ppout;
+	/* key under which to cache the output, if any */
+	char key[65];
+	pid_t pid[LINK];
+	size_t npids;
+	bool failed;
+};
+
+enum timeformat {
+	TIMENONE,
+	TIMETEXT,
+	TIMEJSON,
 };
 
 static struct {
+	enum timeformat time;
 	bool nostdlib;
 	bool verbose;
+	bool cache;
+	/* only check the inputs for errors, writing no output */
+	bool syntaxonly;
+	/* compile the C inputs of a link as a single module */
+	bool wholeprogram;
+	/* preprocess C sources in cproc-qbe rather than with preprocesscmd */
+	bool integratedcpp;
+	/* the cproc-qbe option reporting macro expansion statistics */
+	const char *macrostats;
+	/* report the output of each included file */
+	bool includereport;
+	/* precompile the header inputs, or compile using a precompiled header */
+	bool emitpch, pch;
+	bool nostdinc;
+	unsigned long jobs;
+	/* socket of a cproc-qbe server to run the compile stage */
+	const char *server;
 } flags;
 static struct stageinfo stages[] = {
 	[PREPROCESS] = {.name = "preprocess"},
@@ -62,6 +130,31 @@ static struct stageinfo stages[] = {
 	[ASSEMBLE]   = {.name = "assemble"},
 	[LINK]       = {.name = "link"},
 };
+static struct job *jobs;
+static size_t njobs, maxjobs;
+/* GNU make jobserver */
+static struct {
+	int rfd, wfd;
+	/* tokens held for the running pipelines beyond the first */
+	char *tokens;
+	size_t ntokens;
+} jobserver = {-1, -1};
+/* intermediate files removed once all objects are built */
+static struct array temps;
+/* number of in-memory temporary files currently open */
+static rlim_t nmemfd;
+static struct stagetime linktime;
+static struct timespec starttime;
+/* set once any pipeline has failed; no new pipelines are started after this */
+static bool failed;
+/* preprocessor options in the form taken by cproc-qbe */
+static struct array ppopts;
+
+/* wait4 is not in POSIX, but is available on all supported systems */
+pid_t wait4(pid_t, int *, int, struct rusage *);
+#ifdef __linux__
+int memfd_create(const char *, unsigned);
+#endif
 
 static void
 usage(const char *fmt, ...)
@@ -75,7 +168,7 @@ usage(const char *fmt, ...)
 		va_end(ap);
 		fputc('\n', stderr);
 	}
-	fprintf(stderr, "usage: %s [-c|-S|-E] [-D name[=value]] [-U name] [-s] [-g] [-o output] input...\n", argv0);
+	fprintf(stderr, "usage: %s [-c|-S|-E] [-D name[=value]] [-U name] [-s] [-g] [-j jobs] [-o output] input...\n", argv0);
 	exit(2);
 }
 
@@ -124,6 +217,94 @@ changeext(const char *name, const char *ext)
 	return result;
 }
 
+/*
+Create a temporary file for intermediate output, such as an object that
+is only needed until it is linked. On Linux, this is an in-memory file,
+named through /proc so that the child processes, which inherit the
+descriptor, can open it. *memfd is set to its descriptor, or -1 if the
+file was created in TMPDIR instead.
+
+Every child process inherits these descriptors, and the linker opens
+each object once more, so only use a fraction of the descriptor limit.
+*/
+static char *
+tempfile(int *memfd)
+{
+#ifdef __linux__
+	static bool nomemfd;
+	static rlim_t maxmemfd;
+	struct rlimit rl;
+#endif
+	const char *dir;
+	char *path;
+	size_t len;
+	int fd;
+
+#ifdef __linux__
+	if (maxmemfd == 0) {
+		if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+			rl.rlim_cur = 256;
+		maxmemfd = rl.rlim_cur == RLIM_INFINITY ? RLIM_INFINITY : rl.rlim_cur / 4 + 1;
+	}
+	if (!nomemfd && nmemfd < maxmemfd) {
+		fd = memfd_create("cproc", 0);
+		if (fd >= 0) {
+			path = xmalloc(32);
+			snprintf(path, 32, "/proc/self/fd/%d", fd);
+			if (access(path, R_OK|W_OK) == 0) {
+				++nmemfd;
+				*memfd = fd;
+				return path;
+			}
+			/* /proc is not mounted */
+			nomemfd = true;
+			close(fd);
+			free(path);
+		}
+	}
+#endif
+	dir = getenv("TMPDIR");
+	if (!dir || !dir[0])
+		dir = "/tmp";
+	len = strlen(dir);
+	path = xmalloc(len + sizeof("/cproc-XXXXXX"));
+	memcpy(path, dir, len);
+	strcpy(path + len, "/cproc-XXXXXX");
+	fd = mkstemp(path);
+	if (fd < 0)
+		fatal("mkstemp:");
+	close(fd);
+	*memfd = -1;
+	return path;
+}
+
+static char *
+addtemp(struct array *list)
+{
+	struct temp *t;
+
+	t = arrayadd(list, sizeof(*t));
+	t->path = tempfile(&t->fd);
+	return t->path;
+}
+
+static void
+removetemps(struct array *list)
+{
+	struct temp *t;
+
+	arrayforeach (list, t) {
+		if (t->fd != -1) {
+			close(t->fd);
+			--nmemfd;
+		} else {
+			unlink(t->path);
+		}
+		free(t->path);
+	}
+	list->len = 0;
+}
+
 static int
 spawn(pid_t *pid, struct array *args, posix_spawn_file_actions_t *actions)
 {
@@ -139,8 +320,141 @@ spawn(pid_t *pid, struct array *args, posix_spawn_file_actions_t *actions)
 	return posix_spawnp(pid, *(char **)args->val, actions, NULL, args->val, environ);
 }
 
+/*
+Pass the job descriptors to the compile server, and return its wait
+status, or -1 after a warning if the server could not be reached. This
+runs in a forked child, so it must not exit through fatal(), which
+would flush the stdio buffers inherited from the driver.
+*/
+static int
+remotecompile(int in, int out)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	int sock, fd[3], status;
+	char c = 0;
+
+	if (strlen(flags.server) >= sizeof(addr.sun_path)) {
+		warn("socket path '%s' is too long", flags.server);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, flags.server);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		warn("socket:");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		warn("connect %s:", flags.server);
+		return -1;
+	}
+	fd[0] = in;
+	fd[1] = out;
+	/* diagnostics go to our standard error, not the server's */
+	fd[2] = 2;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), fd, sizeof(fd));
+	if (sendmsg(sock, &msg, 0) != 1) {
+		warn("sendmsg:");
+		return -1;
+	}
+	close(in);
+	close(out);
+	if (read(sock, &status, sizeof(status)) != sizeof(status)) {
+		warn("compile server closed connection");
+		return -1;
+	}
+	return status;
+}
+
+/*
+Run the compile stage on the compile server. This forks a process
+that stands in for the compiler, so that it can be waited on and
+killed like any other stage.
+*/
+static int
+spawnremote(pid_t *pid, int *fd, char *input, char *output, bool last)
+{
+	int in, out, status, pipefd[2];
+
+	if (flags.verbose)
+		fprintf(stderr, "%s: compiling with server %s\n", argv0, flags.server);
+	if (!last && pipe(pipefd) < 0)
+		return errno;
+	*pid = fork();
+	if (*pid < 0) {
+		if (!last) {
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		return errno;
+	}
+	if (*pid == 0) {
+		if (!last)
+			close(pipefd[0]);
+		if (*fd != -1)
+			in = *fd;
+		else if (input)
+			in = open(input, O_RDONLY);
+		else
+			in = 0;
+		if (in < 0) {
+			warn("open %s:", input);
+			_exit(1);
+		}
+		if (!last)
+			out = pipefd[1];
+		else if (output)
+			out = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		else
+			out = 1;
+		if (out < 0) {
+			warn("open %s:", output);
+			_exit(1);
+		}
+		status = remotecompile(in, out);
+		if (status == -1)
+			_exit(1);
+		if (WIFEXITED(status))
+			_exit(WEXITSTATUS(status));
+		if (WIFSIGNALED(status)) {
+			signal(WTERMSIG(status), SIG_DFL);
+			raise(WTERMSIG(status));
+		}
+		_exit(1);
+	}
+	if (*fd != -1)
+		close(*fd);
+	if (!last) {
+		if (fcntl(pipefd[0], F_SETFD, FD_CLOEXEC) < 0)
+			fatal("fcntl:");
+		*fd = pipefd[0];
+		close(pipefd[1]);
+	} else {
+		*fd = -1;
+	}
+	return 0;
+}
+
 static int
-spawnphase(struct stageinfo *phase, int *fd, char *input, char *output, bool last)
+spawnphase(struct stageinfo *phase, pid_t *pid, int *fd, char *input, char *output, bool last)
 {
 	int ret, pipefd[2];
 	posix_spawn_file_actions_t actions;
@@ -177,12 +491,16 @@ spawnphase(struct stageinfo *phase, int *fd, char *input, char *output, bool las
 			goto err2;
 	}
 
-	ret = spawn(&phase->pid, &phase->cmd, &actions);
+	ret = spawn(pid, &phase->cmd, &actions);
 	if (ret)
 		goto err2;
+	if (*fd != -1)
+		close(*fd);
 	if (!last) {
 		*fd = pipefd[0];
 		close(pipefd[1]);
+	} else {
+		*fd = -1;
 	}
 	posix_spawn_file_actions_destroy(&actions);
 
@@ -214,82 +532,631 @@ succeeded(const char *phase, pid_t pid, int status)
 	return false;
 }
 
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static void
-buildobj(struct input *input, char *output)
+starttiming(struct stagetime *t)
+{
+	if (flags.time)
+		clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static void
+stoptiming(struct stagetime *t, const struct rusage *ru)
+{
+	if (!flags.time)
+		return;
+	t->done = true;
+	t->real = elapsed(&t->start);
+	t->user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+	t->sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+	t->maxrss = ru->ru_maxrss;
+}
+
+static void
+printtime(const char *input, const char *stage, const struct stagetime *t, bool first)
+{
+	if (flags.time == TIMEJSON) {
+		fprintf(stderr, "%s\n\t\t{\"stage\": ", first ? "" : ",");
+		jsonstr(stage);
+		if (input) {
+			fputs(", \"input\": ", stderr);
+			jsonstr(input);
+		}
+		fprintf(stderr, ", \"real\": %.6f, \"user\": %.6f, \"sys\": %.6f, \"maxrss\": %ld}", t->real, t->user, t->sys, t->maxrss);
+	} else {
+		fprintf(stderr, "%s: %s: %-10s %8.3fs real %8.3fs user %8.3fs sys %8ld KiB max RSS\n",
+			argv0, input ? input : "total", stage, t->real, t->user, t->sys, t->maxrss);
+	}
+}
+
+/* print the time and resources used by each stage, and totals across all inputs */
+static void
+timereport(struct input *inputs, size_t ninputs)
+{
+	struct stagetime total[LINK] = {0}, *t;
+	struct input *input;
+	enum stage i;
+	bool first;
+
+	if (!flags.time)
+		return;
+	if (flags.time == TIMEJSON)
+		fputs("{\n\t\"stages\": [", stderr);
+	first = true;
+	for (input = inputs; input < inputs + ninputs; ++input) {
+		for (i = PREPROCESS; i < LINK; ++i) {
+			t = &input->time[i];
+			if (!t->done)
+				continue;
+			printtime(strcmp(input->src, "-") == 0 ? "<stdin>" : input->src, stages[i].name, t, first);
+			first = false;
+			total[i].done = true;
+			total[i].real += t->real;
+			total[i].user += t->user;
+			total[i].sys += t->sys;
+			if (total[i].maxrss < t->maxrss)
+				total[i].maxrss = t->maxrss;
+		}
+	}
+	if (flags.time == TIMEJSON)
+		fputs("\n\t],\n\t\"total\": [", stderr);
+	first = true;
+	for (i = PREPROCESS; i < LINK; ++i) {
+		if (total[i].done) {
+			printtime(NULL, stages[i].name, &total[i], first);
+			first = false;
+		}
+	}
+	if (linktime.done)
+		printtime(NULL, stages[LINK].name, &linktime, first);
+	if (flags.time == TIMEJSON)
+		fprintf(stderr, "\n\t],\n\t\"elapsed\": %.6f\n}\n", elapsed(&starttime));
+	else
+		fprintf(stderr, "%s: elapsed: %.3fs\n", argv0, elapsed(&starttime));
+}
+
+/* find the jobserver passed down from make in MAKEFLAGS, if any */
+static void
+jobserverinit(size_t max)
+{
+	const char *makeflags, *pos, *auth;
+	char *path, *end;
+	size_t len;
+	long rfd, wfd;
+
+	makeflags = getenv("MAKEFLAGS");
+	if (!makeflags)
+		return;
+	/* the last option wins; older versions of make use --jobserver-fds */
+	auth = NULL;
+	for (pos = makeflags; (pos = strstr(pos, "--jobserver-")); ++pos) {
+		if (strncmp(pos, "--jobserver-auth=", 17) == 0)
+			auth = pos + 17;
+		else if (strncmp(pos, "--jobserver-fds=", 16) == 0)
+			auth = pos + 16;
+	}
+	if (!auth)
+		return;
+	len = strcspn(auth, " ");
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		path = xmalloc(len - 4);
+		memcpy(path, auth + 5, len - 5);
+		path[len - 5] = '\0';
+		/* our own open file description, so it can be made non-blocking */
+		rfd = open(path, O_RDWR|O_NONBLOCK);
+		free(path);
+		if (rfd < 0 || fcntl(rfd, F_SETFD, FD_CLOEXEC) < 0)
+			return;
+		wfd = rfd;
+	} else {
+		rfd = strtol(auth, &end, 10);
+		if (*end != ',')
+			return;
+		wfd = strtol(end + 1, &end, 10);
+		if (end != auth + len || rfd < 0 || wfd < 0 || rfd > INT_MAX || wfd > INT_MAX)
+			return;
+		/* make only passes the descriptors to recipes it knows are make-aware */
+		if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0)
+			return;
+	}
+	jobserver.rfd = rfd;
+	jobserver.wfd = wfd;
+	jobserver.tokens = xmalloc(max);
+}
+
+/* try to take a token from the jobserver, waiting at most timeout milliseconds */
+static bool
+gettoken(int timeout)
+{
+	struct pollfd pfd;
+	char c;
+
+	pfd.fd = jobserver.rfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0)
+		return false;
+	/* another process may have taken the token in the meantime, in
+	 * which case a blocking read waits for the next one to be freed */
+	if (read(jobserver.rfd, &c, 1) != 1)
+		return false;
+	jobserver.tokens[jobserver.ntokens++] = c;
+	return true;
+}
+
+static void
+puttoken(void)
+{
+	char c;
+
+	c = jobserver.tokens[--jobserver.ntokens];
+	while (write(jobserver.wfd, &c, 1) < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			warn("jobserver write:");
+			break;
+		}
+	}
+}
+
+/* terminate every running pipeline */
+static void
+killjobs(void)
+{
+	struct job *j;
+	size_t i;
+
+	for (j = jobs; j < jobs + njobs; ++j) {
+		j->failed = true;
+		for (i = 0; i < LEN(j->pid); ++i) {
+			if (j->pid[i])
+				kill(j->pid[i], SIGTERM);
+		}
+	}
+	failed = true;
+}
+
+/* spawn a pipeline stage for a job, killing all jobs on failure */
+static bool
+spawnjob(struct job *j, enum stage i, int *fd, char *input, char *output, bool last)
+{
+	int ret;
+
+	starttiming(&j->input->time[i]);
+	if (i == COMPILE && flags.server && !flags.syntaxonly)
+		ret = spawnremote(&j->pid[i], fd, input, output, last);
+	else
+		ret = spawnphase(&stages[i], &j->pid[i], fd, input, output, last);
+	if (ret) {
+		warn("%s: spawn \"%s\": %s", stages[i].name, *(char **)stages[i].cmd.val, strerror(ret));
+		if (*fd != -1)
+			close(*fd);
+		killjobs();
+		return false;
+	}
+	++j->npids;
+	return true;
+}
+
+/* spawn the remaining stages of a job, reading from fd if it is not -1 */
+static void
+spawnstages(struct job *j, int fd)
+{
+	struct input *input = j->input;
+	enum stage i;
+
+	for (i = PREPROCESS; input->stages; ++i) {
+		if (!(input->stages & 1<<i))
+			continue;
+		input->stages &= ~(1<<i);
+		if (!spawnjob(j, i, &fd, j->name, j->output, !input->stages))
+			break;
+	}
+}
+
+/*
+look up the object for the preprocessed source src in the cache,
+and start the remaining stages if it is not there
+*/
+static void
+cachecompile(struct job *j, const char *src)
 {
-	const char *phase;
-	size_t i, npids;
+	struct hash h;
+	struct stat st;
+	enum stage i;
+	char **arg;
+	int fd;
+
+	hashinit(&h);
+	hashupdate(&h, target, sizeof(target));
+	for (i = COMPILE; i <= ASSEMBLE; ++i) {
+		for (arg = stages[i].cmd.val; arg < (char **)stages[i].cmd.val + stages[i].cmdbase / sizeof(*arg); ++arg)
+			hashupdate(&h, *arg, strlen(*arg) + 1);
+	}
+	/* make sure that a rebuilt compiler does not reuse stale objects */
+	arg = stages[COMPILE].cmd.val;
+	if (stat(arg[0], &st) == 0) {
+		hashupdate(&h, &st.st_size, sizeof(st.st_size));
+		hashupdate(&h, &st.st_mtime, sizeof(st.st_mtime));
+	}
+	hashfile(&h, src);
+	hashfinal(&h, j->key);
+	if (cacheget(j->key, j->output)) {
+		if (flags.verbose)
+			fprintf(stderr, "%s: cache hit for %s\n", argv0, j->name ? j->name : "<stdin>");
+		j->input->stages = 0;
+		j->key[0] = '\0';
+		return;
+	}
+	if (flags.verbose)
+		fprintf(stderr, "%s: cache miss for %s\n", argv0, j->name ? j->name : "<stdin>");
+	fd = -1;
+	if (j->ppout) {
+		fd = open(src, O_RDONLY);
+		if (fd < 0)
+			fatal("open %s:", src);
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+			fatal("fcntl:");
+	}
+	spawnstages(j, fd);
+}
+
+static void
+finishjob(struct job *j)
+{
+	if (j->ppout) {
+		if (!j->failed)
+			cachecompile(j, j->ppout);
+		unlink(j->ppout);
+		free(j->ppout);
+		j->ppout = NULL;
+		if (j->npids > 0)
+			return;
+	}
+	if (j->failed) {
+		if (j->output && !j->input->memfd)
+			unlink(j->output);
+	} else if (j->key[0]) {
+		cacheput(j->key, j->output);
+	}
+	*j = jobs[--njobs];
+	/* our own implicit token covers the last running pipeline */
+	if (jobserver.ntokens > 0 && jobserver.ntokens >= njobs)
+		puttoken();
+}
+
+/* reap one child process, and finish its pipeline if it was the last one */
+static bool
+reapjob(int options)
+{
+	struct job *j;
+	size_t i;
+	struct rusage ru;
 	pid_t pid;
-	int status, ret, fd;
-	bool success = true;
+	int status;
+
+	pid = wait4(-1, &status, options, &ru);
+	if (pid < 0)
+		fatal("wait:");
+	if (pid == 0)
+		return false;
+	for (j = jobs; j < jobs + njobs; ++j) {
+		for (i = 0; i < LEN(j->pid); ++i) {
+			if (j->pid[i] == pid)
+				goto found;
+		}
+	}
+	return true;  /* unknown process */
+found:
+	stoptiming(&j->input->time[i], &ru);
+	j->pid[i] = 0;
+	--j->npids;
+	if (!succeeded(stages[i].name, pid, status) && !failed)
+		killjobs();
+	if (j->npids == 0)
+		finishjob(j);
+	return true;
+}
+
+/* wait until at most n pipelines are running */
+static void
+waitjobs(size_t n)
+{
+	while (njobs > n)
+		reapjob(0);
+}
+
+/*
+Wait until another pipeline can be started. Every pipeline but the
+first needs a token from the jobserver, if there is one. Until a token
+is available, we keep reaping our own processes, since once none are
+left we can use our implicit token instead.
+*/
+static void
+waitslot(void)
+{
+	waitjobs(maxjobs - 1);
+	if (jobserver.rfd == -1)
+		return;
+	while (njobs > 0 && !gettoken(JOBSERVERPOLL))
+		reapjob(WNOHANG);
+}
+
+static void
+buildobj(struct input *input, char *output)
+{
+	struct job *j;
+	int fd;
+	bool serial;
 
 	if (input->filetype == OBJ)
 		return;
-	if (input->stages & 1<<LINK) {
+	if (flags.syntaxonly) {
+		output = NULL;
+	} else if (input->stages & 1<<LINK) {
 		input->stages &= ~(1<<LINK);
-		output = strdup("/tmp/cproc-XXXXXX");
-		if (!output)
-			fatal("strdup:");
-		fd = mkstemp(output);
-		if (fd < 0)
-			fatal("mkstemp:");
-		close(fd);
+		output = tempfile(&fd);
+		input->memfd = fd != -1;
 	} else if (output) {
 		if (strcmp(output, "-") == 0)
 			output = NULL;
 	} else if (input->stages & 1<<ASSEMBLE) {
-		output = changeext(input->name, "o");
+		output = changeext(input->src, "o");
 	} else if (input->stages & 1<<CODEGEN) {
-		output = changeext(input->name, "s");
+		output = changeext(input->src, "s");
 	} else if (input->stages & 1<<COMPILE) {
-		output = changeext(input->name, "qbe");
+		output = changeext(input->src, flags.emitpch ? "pch" : "qbe");
 	}
 	if (strcmp(input->name, "-") == 0)
 		input->name = NULL;
 
-	npids = 0;
-	for (i = PREPROCESS, fd = -1; input->stages; ++i) {
-		if (!(input->stages & 1<<i))
+	/* pipelines writing to standard output must not interleave */
+	serial = !output && !flags.syntaxonly;
+	if (serial)
+		waitjobs(0);
+	else
+		waitslot();
+	if (failed)
+		return;
+	j = &jobs[njobs++];
+	j->input = input;
+	j->name = input->name;
+	j->output = output;
+	j->ppout = NULL;
+	j->key[0] = '\0';
+	j->npids = 0;
+	j->failed = false;
+	memset(j->pid, 0, sizeof(j->pid));
+	input->name = output;
+	if (flags.cache && output && (input->stages & ~(1<<PREPROCESS)) == (1<<COMPILE|1<<CODEGEN|1<<ASSEMBLE)) {
+		if (input->stages & 1<<PREPROCESS) {
+			/* preprocess to a file first; the rest of the
+			 * pipeline is started once it has been hashed */
+			input->stages &= ~(1<<PREPROCESS);
+			j->ppout = cachetemp();
+			fd = -1;
+			spawnjob(j, PREPROCESS, &fd, j->name, j->ppout, true);
+		} else if (j->name) {
+			cachecompile(j, j->name);
+		} else {
+			spawnstages(j, -1);
+		}
+	} else {
+		spawnstages(j, -1);
+	}
+	if (j->npids == 0)
+		finishjob(j);
+	else if (serial)
+		waitjobs(0);
+}
+
+/* preprocess the C inputs in list to temporary files, which replace them as inputs */
+static void
+preprocess(struct array *list, struct array *pptemps)
+{
+	struct input **in, *input;
+	unsigned inputstages;
+
+	arrayforeach (list, in) {
+		input = *in;
+		if (!(input->stages & 1<<PREPROCESS))
 			continue;
-		input->stages &= ~(1<<i);
-		ret = spawnphase(&stages[i], &fd, input->name, output, !input->stages);
-		if (ret) {
-			warn("%s: spawn \"%s\": %s", stages[i].name, *(char **)stages[i].cmd.val, strerror(ret));
-			goto kill;
+		inputstages = input->stages;
+		input->stages = 1<<PREPROCESS;
+		buildobj(input, addtemp(pptemps));
+		input->stages = inputstages & ~(1<<PREPROCESS);
+		if (failed)
+			return;
+	}
+	waitjobs(0);
+}
+
+/* start a job running the compile stage with the arguments in cmd */
+static void
+spawncompile(struct input *input, struct array *cmd)
+{
+	struct job *j;
+	int ret;
+
+	j = &jobs[njobs++];
+	memset(j, 0, sizeof(*j));
+	j->input = input;
+	arrayaddptr(cmd, NULL);
+	starttiming(&input->time[COMPILE]);
+	ret = spawn(&j->pid[COMPILE], cmd, NULL);
+	if (ret) {
+		warn("%s: spawn \"%s\": %s", stages[COMPILE].name, *(char **)cmd->val, strerror(ret));
+		killjobs();
+		finishjob(j);
+		return;
+	}
+	++j->npids;
+}
+
+/*
+When there are more C inputs than can be compiled at once, compile them
+in batches, several translation units to one cproc-qbe process, to save
+its start-up cost. The batched inputs are first preprocessed to
+temporary files, and each batch is then compiled to temporary QBE files,
+which are built like any other QBE input afterwards.
+*/
+static void
+buildbatches(struct input *inputs, size_t ninputs)
+{
+	struct array batch = {0}, pptemps = {0};
+	struct stageinfo *s = &stages[COMPILE];
+	struct input *input, **in;
+	size_t i, n, size;
+
+	for (input = inputs; input < inputs + ninputs; ++input) {
+		if ((input->stages & (1<<COMPILE|1<<CODEGEN)) == (1<<COMPILE|1<<CODEGEN) && strcmp(input->name, "-") != 0)
+			arrayaddptr(&batch, input);
+	}
+	n = batch.len / sizeof(input);
+	if (n <= maxjobs) {
+		free(batch.val);
+		return;
+	}
+	size = (n + maxjobs - 1) / maxjobs;
+	if (size > BATCHMAX)
+		size = BATCHMAX;
+
+	preprocess(&batch, &pptemps);
+	for (i = 0; i < n && !failed; i += size) {
+		waitslot();
+		if (failed)
+			break;
+		in = (struct input **)batch.val + i;
+		s->cmd.len = s->cmdbase;
+		arrayaddptr(&s->cmd, "-b");
+		for (; in < (struct input **)batch.val + n && in < (struct input **)batch.val + i + size; ++in) {
+			input = *in;
+			arrayaddptr(&s->cmd, input->name);
+			input->name = addtemp(&temps);
+			arrayaddptr(&s->cmd, input->name);
+			input->stages &= ~(1<<COMPILE);
 		}
-		++npids;
+		spawncompile(((struct input **)batch.val)[i], &s->cmd);
 	}
-	input->name = output;
+	waitjobs(0);
+	removetemps(&pptemps);
+	free(pptemps.val);
+	free(batch.val);
+}
 
-	while (npids > 0) {
-		pid = wait(&status);
-		if (pid < 0)
-			fatal("waitpid:");
-		for (i = 0; i < LEN(stages); ++i) {
-			if (pid == stages[i].pid) {
-				--npids;
-				stages[i].pid = 0;
-				phase = stages[i].name;
-				break;
-			}
+/*
+With -fwhole-program, the C inputs of a link are compiled by a single
+cproc-qbe process into one QBE module, in which only the definitions
+reachable from main are emitted. If some other input may refer to
+them, including a library, which may call back into the program (as
+libfl calls yylex), every external definition is kept as well. The
+module replaces the first C input, and the others are removed from the
+list. Returns the new number of inputs.
+*/
+static size_t
+buildprogram(struct input *inputs, size_t ninputs)
+{
+	struct array merge = {0}, pptemps = {0};
+	struct stageinfo *s = &stages[COMPILE];
+	struct input *input, *out, *first, **in;
+	char *output;
+	bool root;
+
+	root = !flags.nostdlib;
+	for (input = inputs; input < inputs + ninputs; ++input) {
+		if ((input->stages & (1<<COMPILE|1<<CODEGEN)) == (1<<COMPILE|1<<CODEGEN) && strcmp(input->name, "-") != 0)
+			arrayaddptr(&merge, input);
+		else if (input->stages)
+			root = false;
+	}
+	if (merge.len == 0)
+		return ninputs;
+	first = *(struct input **)merge.val;
+
+	preprocess(&merge, &pptemps);
+	if (!failed) {
+		output = addtemp(&temps);
+		s->cmd.len = s->cmdbase;
+		arrayaddptr(&s->cmd, "-w");
+		if (root) {
+			arrayaddptr(&s->cmd, "-r");
+			arrayaddptr(&s->cmd, "main");
 		}
-		if (i == LEN(stages))
-			continue;  /* unknown process */
-		if (!succeeded(phase, pid, status)) {
-kill:
-			if (success && npids > 0) {
-				for (i = 0; i < LEN(stages); ++i) {
-					if (stages[i].pid)
-						kill(stages[i].pid, SIGTERM);
-				}
-			}
-			success = false;
+		arrayaddptr(&s->cmd, "-o");
+		arrayaddptr(&s->cmd, output);
+		arrayforeach (&merge, in)
+			arrayaddptr(&s->cmd, (*in)->name);
+		first->name = output;
+		first->stages &= ~(1<<COMPILE);
+		spawncompile(first, &s->cmd);
+		waitjobs(0);
+	}
+	removetemps(&pptemps);
+	free(pptemps.val);
+
+	arrayforeach (&merge, in) {
+		if (*in != first)
+			(*in)->name = NULL;
+	}
+	free(merge.val);
+	out = inputs;
+	for (input = inputs; input < inputs + ninputs; ++input) {
+		if (input->name)
+			*out++ = *input;
+	}
+	return out - inputs;
+}
+
+/*
+With -fintegrated-cpp, C sources are preprocessed by cproc-qbe as part
+of the compile stage. It is given the preprocessor options, and the
+macros and include directories of the system that preprocesscmd would
+otherwise provide. Other sources still use preprocesscmd.
+*/
+static void
+integratecpp(struct input *inputs, size_t ninputs)
+{
+	struct array *cmd = &stages[COMPILE].cmd;
+	struct input *input;
+	const char *dir;
+	size_t i;
+
+	dir = getenv("CPROC_TOKEN_CACHE_DIR");
+	if (dir && *dir) {
+		arrayaddptr(cmd, "-H");
+		arrayaddptr(cmd, (char *)dir);
+	}
+	if (flags.macrostats) {
+		arrayaddptr(cmd, (char *)flags.macrostats);
+		arrayaddptr(cmd, "20");
+	}
+	for (i = 0; i < LEN(sysdefines); ++i) {
+		arrayaddptr(cmd, "-D");
+		arrayaddptr(cmd, (char *)sysdefines[i]);
+	}
+	/* preprocesscmd also adjusts the definitions for cproc */
+	for (i = 1; i + 1 < LEN(preprocesscmd); ++i) {
+		if (strcmp(preprocesscmd[i], "-D") == 0 || strcmp(preprocesscmd[i], "-U") == 0) {
+			arrayaddptr(cmd, (char *)preprocesscmd[i]);
+			arrayaddptr(cmd, (char *)preprocesscmd[++i]);
+		}
+	}
+	arrayaddbuf(cmd, ppopts.val, ppopts.len);
+	if (!flags.nostdinc) {
+		for (i = 0; i < LEN(sysincludes); ++i) {
+			arrayaddptr(cmd, "-S");
+			arrayaddptr(cmd, (char *)sysincludes[i]);
 		}
 	}
-	if (!success) {
-		if (output)
-			unlink(output);
-		exit(1);
+	for (input = inputs; input < inputs + ninputs; ++input) {
+		if (input->filetype == C)
+			input->stages &= ~(1<<PREPROCESS);
 	}
 }
 
@@ -297,6 +1164,7 @@ static void
 buildexe(struct input *inputs, size_t ninputs, char *output)
 {
 	struct stageinfo *s = &stages[LINK];
+	struct rusage ru;
 	size_t i;
 	int ret, status;
 	pid_t pid;
@@ -314,15 +1182,18 @@ buildexe(struct input *inputs, size_t ninputs, char *output)
 		arrayaddbuf(&s->cmd, endfiles, sizeof(endfiles));
 	arrayaddptr(&s->cmd, NULL);
 
+	starttiming(&linktime);
 	ret = spawn(&pid, &s->cmd, NULL);
 	if (ret)
 		fatal("%s: spawn \"%s\": %s", s->name, *(char **)s->cmd.val, strerror(errno));
-	if (waitpid(pid, &status, 0) < 0)
+	if (wait4(pid, &status, 0, &ru) < 0)
 		fatal("waitpid %ju:", (uintmax_t)pid);
+	stoptiming(&linktime, &ru);
 	for (i = 0; i < ninputs; ++i) {
-		if (inputs[i].filetype != OBJ)
+		if (inputs[i].filetype != OBJ && !inputs[i].memfd)
 			unlink(inputs[i].name);
 	}
+	timereport(inputs, ninputs);
 	exit(!succeeded(s->name, pid, status));
 }
 
@@ -359,6 +1230,36 @@ compilecommand(char *arg)
 	return cmd;
 }
 
+static unsigned long
+ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+static unsigned long long
+cachesize(const char *str)
+{
+	unsigned long long size;
+	char *end;
+
+	size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G': size *= 1024;  /* fallthrough */
+	case 'M': size *= 1024;  /* fallthrough */
+	case 'K': size *= 1024; ++end;
+	}
+	if (*end || end == str)
+		fatal("invalid cache size '%s'", str);
+	return size;
+}
+
 static int
 hasprefix(const char *str, const char *pfx)
 {
@@ -374,8 +1275,13 @@ main(int argc, char *argv[])
 	struct array inputs = {0}, *cmd;
 	struct input *input;
 	size_t i;
+	/* -MD derives the dependency file name from the preprocessor output */
+	bool depfile = false;
+	/* the preprocessor was given options only it understands */
+	bool cppargs = false;
 
 	argv0 = progname(argv[0], "cproc");
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
 
 	arrayaddbuf(&stages[PREPROCESS].cmd, preprocesscmd, sizeof(preprocesscmd));
 	arrayaddptr(&stages[COMPILE].cmd, compilecommand(argv[0]));
@@ -408,7 +1314,9 @@ main(int argc, char *argv[])
 			break;
 		if (arg[0] != '-' || arg[1] == '\0') {
 			input = arrayadd(&inputs, sizeof(*input));
+			memset(input, 0, sizeof(*input));
 			input->name = arg;
+			input->src = arg;
 			input->lib = false;
 			input->filetype = filetype == NONE && arg[1] ? detectfiletype(arg) : filetype;
 			switch (input->filetype) {
@@ -427,16 +1335,59 @@ main(int argc, char *argv[])
 		if (strcmp(arg, "-nostdlib") == 0) {
 			flags.nostdlib = true;
 		} else if (strcmp(arg, "-nostdinc") == 0) {
+			flags.nostdinc = true;
 			arrayaddptr(&stages[PREPROCESS].cmd, arg);
 		} else if (strcmp(arg, "-static") == 0) {
 			arrayaddptr(&stages[LINK].cmd, arg);
 		} else if (strcmp(arg, "-emit-qbe") == 0) {
 			last = COMPILE;
+		} else if (strcmp(arg, "-fsyntax-only") == 0) {
+			last = COMPILE;
+			flags.syntaxonly = true;
+			arrayaddptr(&stages[COMPILE].cmd, "-s");
+		} else if (strcmp(arg, "-emit-pch") == 0) {
+			last = COMPILE;
+			flags.emitpch = true;
+			arrayaddptr(&stages[COMPILE].cmd, "-e");
+		} else if (strcmp(arg, "-include-pch") == 0) {
+			if (!--argc)
+				usage(NULL);
+			flags.pch = true;
+			arrayaddptr(&ppopts, "-p");
+			arrayaddptr(&ppopts, *++argv);
+		} else if (strcmp(arg, "-fwhole-program") == 0) {
+			flags.wholeprogram = true;
+		} else if (strcmp(arg, "-fintegrated-cpp") == 0) {
+			flags.integratedcpp = true;
+		} else if (strcmp(arg, "-fno-integrated-cpp") == 0) {
+			flags.integratedcpp = false;
+		} else if (strcmp(arg, "-fmacro-stats") == 0) {
+			flags.macrostats = "-m";
+		} else if (strcmp(arg, "-fmacro-stats=json") == 0) {
+			flags.macrostats = "-M";
+		} else if (strcmp(arg, "-include-report") == 0) {
+			arrayaddptr(&stages[COMPILE].cmd, "-R");
+			flags.includereport = true;
+		} else if (strcmp(arg, "-time") == 0) {
+			flags.time = TIMETEXT;
+		} else if (strcmp(arg, "-time=json") == 0) {
+			flags.time = TIMEJSON;
+		} else if (strcmp(arg, "-compile-server") == 0) {
+			if (!--argc)
+				usage(NULL);
+			flags.server = *++argv;
 		} else if (strcmp(arg, "-include") == 0 || strcmp(arg, "-idirafter") == 0 || strcmp(arg, "-isystem") == 0 || strcmp(arg, "-iquote") == 0) {
 			if (!--argc)
 				usage(NULL);
 			arrayaddptr(&stages[PREPROCESS].cmd, arg);
 			arrayaddptr(&stages[PREPROCESS].cmd, *++argv);
+			switch (arg[2]) {
+			case 'n': arrayaddptr(&ppopts, "-i"); break;
+			case 'd': arrayaddptr(&ppopts, "-A"); break;
+			case 's': arrayaddptr(&ppopts, "-S"); break;
+			case 'q': arrayaddptr(&ppopts, "-Q"); break;
+			}
+			arrayaddptr(&ppopts, *argv);
 		} else if (strcmp(arg, "-pipe") == 0) {
 			/* ignore */
 		} else if (strncmp(arg, "-std=", 5) == 0) {
@@ -456,8 +1407,11 @@ main(int argc, char *argv[])
 				last = ASSEMBLE;
 				break;
 			case 'D':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-D");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppopts, "-D");
+				arrayaddptr(&ppopts, arg);
 				break;
 			case 'E':
 				last = PREPROCESS;
@@ -466,8 +1420,17 @@ main(int argc, char *argv[])
 				/* ignore */
 				break;
 			case 'I':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-I");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppopts, "-I");
+				arrayaddptr(&ppopts, arg);
+				break;
+			case 'j':
+				arg = nextarg(&argv);
+				flags.jobs = strtoul(arg, &end, 10);
+				if (*end || flags.jobs == 0)
+					usage("invalid number of jobs '%s'", arg);
 				break;
 			case 'L':
 				arrayaddptr(&stages[LINK].cmd, "-L");
@@ -475,7 +1438,9 @@ main(int argc, char *argv[])
 				break;
 			case 'l':
 				input = arrayadd(&inputs, sizeof(*input));
+				memset(input, 0, sizeof(*input));
 				input->name = nextarg(&argv);
+				input->src = input->name;
 				input->lib = true;
 				input->filetype = OBJ;
 				input->stages = 1<<LINK;
@@ -486,6 +1451,7 @@ main(int argc, char *argv[])
 					last = PREPROCESS;
 				} else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
 					arrayaddptr(&stages[PREPROCESS].cmd, arg);
+					depfile = true;
 				} else if (strcmp(arg, "-MT") == 0 || strcmp(arg, "-MF") == 0) {
 					if (!--argc)
 						usage(NULL);
@@ -511,8 +1477,11 @@ main(int argc, char *argv[])
 				arrayaddptr(&stages[LINK].cmd, "-s");
 				break;
 			case 'U':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-U");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppopts, "-U");
+				arrayaddptr(&ppopts, arg);
 				break;
 			case 'v':
 				flags.verbose = true;
@@ -520,7 +1489,7 @@ main(int argc, char *argv[])
 			case 'W':
 				if (arg[2] && arg[3] == ',') {
 					switch (arg[2]) {
-					case 'p': cmd = &stages[PREPROCESS].cmd; break;
+					case 'p': cmd = &stages[PREPROCESS].cmd; cppargs = true; break;
 					case 'a': cmd = &stages[ASSEMBLE].cmd; break;
 					case 'l': cmd = &stages[LINK].cmd; break;
 					default: usage(NULL);
@@ -560,10 +1529,14 @@ main(int argc, char *argv[])
 		}
 	}
 
-	for (i = 0; i < LEN(stages); ++i)
-		stages[i].cmdbase = stages[i].cmd.len;
 	if (inputs.len == 0)
 		usage(NULL);
+	/* the server only receives the job's files, so these are compiled locally */
+	if (flags.server && (flags.includereport || flags.macrostats)) {
+		if (flags.verbose)
+			fprintf(stderr, "%s: not using server %s for -include-report or -fmacro-stats\n", argv0, flags.server);
+		flags.server = NULL;
+	}
 	if (output) {
 		if (strcmp(output, "-") == 0) {
 			if (last >= ASSEMBLE)
@@ -572,18 +1545,70 @@ main(int argc, char *argv[])
 			usage("cannot specify -o with multiple input files without linking");
 		}
 	}
+	/* precompiled headers are only read and written by the integrated preprocessor */
+	if (flags.emitpch || flags.pch) {
+		if (last == PREPROCESS || depfile || cppargs || flags.server || flags.wholeprogram)
+			usage("precompiled headers cannot be used with -E, -M, -MD, -MMD, -Wp, -fwhole-program, or -compile-server");
+		if (flags.emitpch && (flags.pch || flags.syntaxonly))
+			usage("-emit-pch cannot be used with -include-pch or -fsyntax-only");
+		flags.integratedcpp = true;
+	}
+	if (flags.emitpch) {
+		if (output && strcmp(output, "-") == 0)
+			usage("cannot write precompiled header to stdout");
+		arrayforeach (&inputs, input) {
+			if (input->filetype != C && input->filetype != CHDR)
+				continue;
+			if (strcmp(input->name, "-") == 0)
+				usage("cannot precompile standard input");
+			input->stages = 1<<COMPILE;
+		}
+	}
+	arg = getenv("CPROC_CACHE_DIR");
+	if (arg && *arg && !depfile && !flags.emitpch && !flags.pch) {
+		end = getenv("CPROC_CACHE_SIZE");
+		cacheinit(arg, end && *end ? cachesize(end) : DEFCACHESIZE);
+		flags.cache = true;
+	}
+	/* the cache is keyed on the preprocessed source, and the compile server has its own options */
+	if (flags.integratedcpp && last > PREPROCESS && !depfile && !cppargs && !flags.cache && !flags.server)
+		integratecpp(inputs.val, inputs.len / sizeof(*input));
+	for (i = 0; i < LEN(stages); ++i)
+		stages[i].cmdbase = stages[i].cmd.len;
+	if (flags.jobs == 0)
+		flags.jobs = ncpus();
+	maxjobs = inputs.len / sizeof(*input);
+	if (maxjobs > flags.jobs)
+		maxjobs = flags.jobs;
+	jobs = xreallocarray(NULL, maxjobs, sizeof(*jobs));
+	if (maxjobs > 1)
+		jobserverinit(maxjobs);
 	arrayforeach (&inputs, input) {
 		/* ignore the input if it doesn't participate in the last stage */
 		if (!(input->stages & 1 << last))
-			continue;
+			input->stages = 0;
 		/* only run up through the last stage */
 		input->stages &= (1 << last + 1) - 1;
-		buildobj(input, output);
 	}
+	if (flags.wholeprogram && last == LINK && !depfile)
+		inputs.len = buildprogram(inputs.val, inputs.len / sizeof(*input)) * sizeof(*input);
+	else if (!flags.cache && !flags.server && !flags.time && !depfile)
+		buildbatches(inputs.val, inputs.len / sizeof(*input));
+	arrayforeach (&inputs, input) {
+		if (failed)
+			break;
+		if (input->stages)
+			buildobj(input, output);
+	}
+	waitjobs(0);
+	removetemps(&temps);
+	if (failed)
+		return 1;
 	if (last == LINK) {
 		if (!output)
 			output = "a.out";
 		buildexe(inputs.val, inputs.len / sizeof(*input), output);
 	}
+	timereport(inputs.val, inputs.len / sizeof(*input));
 	return 0;
 }
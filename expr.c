@@ -85,6 +85,20 @@ mkconstexpr(struct type *t, unsigned long long n)
 	return e;
 }
 
+/* the bytes of #embed initializing elements of type t, as a string literal */
+struct expr *
+embedexpr(struct type *t, unsigned char *data, size_t len)
+{
+	struct expr *e;
+
+	e = mkexpr(EXPRSTRING, mkarraytype(t, QUALNONE, len), NULL);
+	e->lvalue = true;
+	e->u.string.data = data;
+	e->u.string.size = len;
+
+	return e;
+}
+
 static struct expr *mkunaryexpr(enum tokenkind, struct expr *);
 
 /* 6.3.2.1 Conversion of arrays and function designators */
@@ -499,6 +513,26 @@ encodechar32(void *dst, uint_least32_t chr, bool hexoct)
 	return sizeof(uint_least32_t);
 }
 
+/* decode the character constant src, returning its value and storing its type in *t */
+unsigned long
+charvalue(const char *src, struct type **t, struct location *loc)
+{
+	uint_least32_t chr;
+
+	switch (*src) {
+	case 'L': ++src; *t = targ->typewchar; break;
+	case 'u': ++src; *t = *src == '8' ? ++src, &typeuchar : &typeushort; break;
+	case 'U': ++src; *t = &typeuint; break;
+	default: *t = &typeint;
+	}
+	assert(*src == '\'');
+	++src;
+	src += decodechar(src, &chr, NULL, "character constant", loc);
+	if (*src != '\'')
+		error(loc, "character constant contains more than one character: %c", *src);
+	return chr;
+}
+
 struct type *
 stringconcat(struct stringlit *str, bool forceutf8)
 {
@@ -666,19 +700,8 @@ primaryexpr(struct scope *s)
 		e = decay(e);
 		break;
 	case TCHARCONST:
-		src = tok.lit;
-		switch (*src) {
-		case 'L': ++src; t = targ->typewchar; break;
-		case 'u': ++src; t = *src == '8' ? ++src, &typeuchar : &typeushort; break;
-		case 'U': ++src; t = &typeuint; break;
-		default: t = &typeint;
-		}
-		assert(*src == '\'');
-		++src;
-		src += decodechar(src, &chr, NULL, "character constant", &tok.loc);
+		chr = charvalue(tok.lit, &t, &tok.loc);
 		e = mkconstexpr(t, chr);
-		if (*src != '\'')
-			error(&tok.loc, "character constant contains more than one character: %c", *src);
 		next();
 		break;
 	case TNUMBER:
@@ -771,7 +794,6 @@ designator(struct scope *s, struct type *t, unsigned long long *offset)
 			m = typemember(t, name, offset);
 			if (!m)
 				error(&tok.loc, "%s has no member named '%s'", t->kind == TYPEUNION ? "union" : "struct", name);
-			free(name);
 			t = m->type;
 			break;
 		default:
@@ -830,7 +852,6 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 			error(&tok.loc, "struct/union has no member named '%s'", name);
 		designator(s, m->type, &offset);
 		e = mkconstexpr(&typeulong, offset);
-		free(name);
 		break;
 	case BUILTINTYPESCOMPATIBLEP:
 		t = typename(s, NULL, NULL);
@@ -1323,6 +1344,8 @@ assignexpr(struct scope *s)
 	}
 	if (!l->lvalue)
 		error(&tok.loc, "left side of assignment expression is not an lvalue");
+	if (l->qual & QUALCONST)
+		error(&tok.loc, "left side of assignment expression is const qualified");
 	next();
 	r = assignexpr(s);
 	if (!op)
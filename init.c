@@ -80,7 +80,7 @@ findmember(struct initparser *p, char *name)
 
 	for (m = p->sub->type->u.structunion.members; m; m = m->next) {
 		if (m->name) {
-			if (strcmp(m->name, name) == 0) {
+			if (m->name == name) {
 				p->sub->u.mem = m;
 				subobj(p, m->type, m->offset);
 				return true;
@@ -126,7 +126,6 @@ designator(struct scope *s, struct initparser *p)
 			name = expect(TIDENT, "for member designator");
 			if (!findmember(p, name))
 				error(&tok.loc, "%s has no member named '%s'", t->kind == TYPEUNION ? "union" : "struct", name);
-			free(name);
 			break;
 		default:
 			expect(TASSIGN, "after designator");
@@ -190,6 +189,40 @@ advance(struct initparser *p)
 	}
 }
 
+/*
+Add the bytes of an #embed that begins the next initializer, if it
+initializes elements of an array of character type, all at once as a
+string literal. They never become tokens or expressions, so large
+resources can be embedded cheaply.
+*/
+static bool
+embedinit(struct initparser *p)
+{
+	struct object *arr;
+	unsigned char *data;
+	size_t n;
+
+	data = ppembed(&n);
+	if (!data)
+		return false;
+	/* the first byte goes to the first scalar, as for any other expression */
+	while (!(p->sub->type->prop & PROPSCALAR))
+		focus(p);
+	arr = p->sub - 1;
+	if (p->sub == p->obj || arr->type->kind != TYPEARRAY || !(p->sub->type->prop & PROPCHAR))
+		return false;
+	if (!arr->type->incomplete && n > arr->type->size - arr->u.idx)
+		n = arr->type->size - arr->u.idx;
+	ppembedskip(n);
+	initadd(p, mkinit(p->sub->offset, p->sub->offset + n, (struct bitfield){0}, embedexpr(p->sub->type, data, n)));
+	/* continue after the last element, as if it had been initialized by itself */
+	arr->u.idx += n - 1;
+	p->sub->offset += n - 1;
+	if (arr->type->incomplete && arr->type->size < arr->u.idx + 1)
+		arr->type->size = arr->u.idx + 1;
+	return true;
+}
+
 /* 6.7.9 Initialization */
 struct init *
 parseinit(struct scope *s, struct type *t)
@@ -235,6 +268,8 @@ parseinit(struct scope *s, struct type *t)
 			p.cur->iscur = true;
 			continue;
 		}
+		if (p.cur && embedinit(&p))
+			goto next;
 		expr = assignexpr(s);
 		for (;;) {
 			t = p.sub->type;
@@ -5,40 +5,220 @@
 #include "arg.h"
 #include "cc.h"
 
+static bool pponly;
+/* number of macros to report statistics for, and whether to report them as JSON */
+static size_t macrostats;
+static bool macrostatsjson;
+/* the precompiled header to load, or the prefix header to precompile */
+static char *pch, *prefix;
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [input]\n", argv0);
+	fprintf(stderr, "usage: %s [-E] [-t target] [-D name[=value]] [-U name] [-i file] [-I|-Q|-S|-A dir]... [-H dir] [-p pch] [-m|-M count] [-R] [-o output] [input]\n", argv0);
+	fprintf(stderr, "       %s -e [-t target] [-D name[=value]] [-U name] [-I|-Q|-S|-A dir]... -o output header\n", argv0);
+	fprintf(stderr, "       %s -s [-t target] [input]\n", argv0);
+	fprintf(stderr, "       %s [-E] [-t target] -b input output [input output]...\n", argv0);
+	fprintf(stderr, "       %s -w [-t target] [-r root]... [-o output] input...\n", argv0);
+	fprintf(stderr, "       %s [-E] [-t target] -l socket\n", argv0);
 	exit(2);
 }
 
+/* process the translation unit read by the scanner */
+static void
+translate(void)
+{
+	if (pch)
+		pchload(pch);
+	ppinit();
+	if (pponly) {
+		ppflags |= PPNEWLINE;
+		while (tok.kind != TEOF) {
+			tokenprint(&tok);
+			next();
+		}
+		tokenflush();
+	} else {
+		while (tok.kind != TEOF) {
+			if (includereport)
+				reportbegin();
+			if (!decl(&filescope, NULL)) {
+				if (tok.kind == TSEMICOLON)
+					error(&tok.loc, "unexpected ';' at top-level");
+				error(&tok.loc, "expected declaration or function definition");
+			}
+			if (includereport)
+				reportend();
+		}
+		/* tentative definitions are left to the translation units using the prefix */
+		if (prefix)
+			pchsave(prefix);
+		else
+			emittentativedefns();
+	}
+	if (ppflags & PPSTATS)
+		ppstats(macrostats, macrostatsjson);
+	if (includereport)
+		reportprint();
+	fflush(stdout);
+	if (ferror(stdout))
+		fatal("write failed");
+}
+
+/* discard all state left over from the previous translation unit */
+static void
+reset(void)
+{
+	scanclose();
+	ppreset();
+	if (!pponly) {
+		scopereset();
+		declreset();
+		emitreset();
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
-	bool pponly = false;
-	char *output = NULL, *target = NULL;
+	bool batch = false;
+	char *output = NULL, *target = NULL, *server = NULL, *end;
+	FILE *empty;
 
 	argv0 = progname(argv[0], "cproc-qbe");
 	ARGBEGIN {
 	case 'E':
 		pponly = true;
 		break;
+	case 'e':
+		prefix = "";
+		break;
+	case 'p':
+		pch = EARGF(usage());
+		break;
 	case 't':
 		target = EARGF(usage());
 		break;
 	case 'o':
 		output = EARGF(usage());
 		break;
+	case 'l':
+		server = EARGF(usage());
+		break;
+	case 'b':
+		batch = true;
+		break;
+	case 's':
+		syntaxonly = true;
+		break;
+	case 'w':
+		wholeprogram = true;
+		break;
+	case 'r':
+		emitroot(EARGF(usage()));
+		break;
+	case 'I':
+		ppincdir(INCUSER, EARGF(usage()));
+		break;
+	case 'Q':
+		ppincdir(INCQUOTE, EARGF(usage()));
+		break;
+	case 'S':
+		ppincdir(INCSYSTEM, EARGF(usage()));
+		break;
+	case 'A':
+		ppincdir(INCAFTER, EARGF(usage()));
+		break;
+	case 'D':
+		ppdefine(EARGF(usage()));
+		break;
+	case 'U':
+		ppundef(EARGF(usage()));
+		break;
+	case 'i':
+		ppinclude(EARGF(usage()));
+		break;
+	case 'H':
+		tokcachedir = EARGF(usage());
+		break;
+	case 'R':
+		includereport = true;
+		break;
+	case 'M':
+		macrostatsjson = true;
+		/* fallthrough */
+	case 'm':
+		ppflags |= PPSTATS;
+		macrostats = strtoul(EARGF(usage()), &end, 10);
+		if (*end)
+			usage();
+		break;
 	default:
 		usage();
 	} ARGEND
 
 	targinit(target);
+	if (!pponly)
+		scopeinit();
+	if (pch && (pponly || wholeprogram))
+		usage();
+	if (server) {
+		if (output || argc || batch || wholeprogram || prefix)
+			usage();
+		serve(server);
+	}
 
+	if (batch) {
+		/* compile each input to its own output, as if by separate processes */
+		if (output || argc == 0 || argc % 2 || prefix)
+			usage();
+		for (; argc; argc -= 2, argv += 2) {
+			if (!freopen(argv[1], "w", stdout))
+				fatal("open %s:", argv[1]);
+			scanfrom(argv[0], NULL);
+			scanopen();
+			translate();
+			reset();
+		}
+		return 0;
+	}
+
+	if (wholeprogram) {
+		/* compile each input separately, but into a single module */
+		if (argc == 0 || pponly || syntaxonly || batch || prefix)
+			usage();
+		if (output && !freopen(output, "w", stdout))
+			fatal("open %s:", output);
+		for (; argc; --argc, ++argv) {
+			scanfrom(*argv, NULL);
+			scanopen();
+			translate();
+			reset();
+		}
+		emitprogram();
+		fflush(stdout);
+		if (ferror(stdout))
+			fatal("write failed");
+		return 0;
+	}
+
+	if (syntaxonly && (output || pponly))
+		usage();
 	if (output && !freopen(output, "w", stdout))
 		fatal("open %s:", output);
 
-	if (argc) {
+	if (prefix) {
+		/* the prefix is read as if by -i, before an empty source file */
+		if (!output || argc != 1 || pponly || syntaxonly || pch)
+			usage();
+		prefix = argv[0];
+		ppinclude(prefix);
+		empty = tmpfile();
+		if (!empty)
+			fatal("tmpfile:");
+		scanfrom(prefix, empty);
+		pchcreate();
+	} else if (argc) {
 		while (argc--)
 			scanfrom(argv[argc], NULL);
 		scanopen();
@@ -46,27 +226,6 @@ main(int argc, char *argv[])
 		scanfrom("<stdin>", stdin);
 	}
 
-	ppinit();
-	if (pponly) {
-		ppflags |= PPNEWLINE;
-		while (tok.kind != TEOF) {
-			tokenprint(&tok);
-			next();
-		}
-	} else {
-		scopeinit();
-		while (tok.kind != TEOF) {
-			if (!decl(&filescope, NULL)) {
-				if (tok.kind == TSEMICOLON)
-					error(&tok.loc, "unexpected ';' at top-level");
-				error(&tok.loc, "expected declaration or function definition");
-			}
-		}
-		emittentativedefns();
-	}
-
-	fflush(stdout);
-	if (ferror(stdout))
-		fatal("write failed");
+	translate();
 	return 0;
 }
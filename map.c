@@ -1,9 +1,22 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "util.h"
 
+struct ident {
+	unsigned long hash;
+	size_t len;
+	int val;
+	char str[];
+};
+
+static struct {
+	struct ident **ents;
+	size_t len, cap;
+} idents;
+
 static unsigned long
 hash(const void *ptr, size_t len)
 {
@@ -57,6 +70,8 @@ mapfree(struct map *h, void del(void *))
 static bool
 keyequal(struct mapkey *k1, struct mapkey *k2)
 {
+	if (k1->str == k2->str)
+		return true;
 	if (k1->hash != k2->hash || k1->len != k2->len)
 		return false;
 	return memcmp(k1->str, k2->str, k1->len) == 0;
@@ -117,3 +132,67 @@ mapget(struct map *h, struct mapkey *k)
 	i = keyindex(h, k);
 	return h->keys[i].str ? h->vals[i] : NULL;
 }
+
+/*
+Return the unique copy of the string s of length n. Interned strings
+are never freed, and store their hash so that they can be used as map
+keys without hashing them again.
+*/
+char *
+intern(const char *s, size_t n)
+{
+	struct ident **oldents, *id;
+	unsigned long h;
+	size_t i, j, oldcap;
+
+	if (idents.cap / 2 <= idents.len) {
+		oldents = idents.ents;
+		oldcap = idents.cap;
+		idents.cap = oldcap ? oldcap * 2 : 1<<10;
+		idents.ents = xreallocarray(NULL, idents.cap, sizeof(idents.ents[0]));
+		for (i = 0; i < idents.cap; ++i)
+			idents.ents[i] = NULL;
+		for (i = 0; i < oldcap; ++i) {
+			id = oldents[i];
+			if (!id)
+				continue;
+			for (j = id->hash & idents.cap - 1; idents.ents[j]; j = j + 1 & idents.cap - 1)
+				;
+			idents.ents[j] = id;
+		}
+		free(oldents);
+	}
+	h = hash(s, n);
+	for (i = h & idents.cap - 1; (id = idents.ents[i]); i = i + 1 & idents.cap - 1) {
+		if (id->hash == h && id->len == n && memcmp(id->str, s, n) == 0)
+			return id->str;
+	}
+	id = xmalloc(offsetof(struct ident, str) + n + 1);
+	id->hash = h;
+	id->len = n;
+	id->val = 0;
+	memcpy(id->str, s, n);
+	id->str[n] = '\0';
+	idents.ents[i] = id;
+	++idents.len;
+	return id->str;
+}
+
+/* initialize a map key for a string returned by intern */
+void
+internkey(struct mapkey *k, const char *s)
+{
+	const struct ident *id;
+
+	id = (const struct ident *)(s - offsetof(struct ident, str));
+	k->str = s;
+	k->len = id->len;
+	k->hash = id->hash;
+}
+
+/* return the value associated with a string returned by intern, initially 0 */
+int *
+internval(const char *s)
+{
+	return &((struct ident *)(s - offsetof(struct ident, str)))->val;
+}
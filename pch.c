@@ -0,0 +1,546 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "cc.h"
+
+/*
+A precompiled header is a snapshot of the compiler's state after
+reading a prefix header, in four parts:
+
+- a header describing the rest of the file
+- the QBE emitted while reading the prefix, which is copied to the
+  output of each translation unit using it
+- a blob holding the saved objects in their native layout, with every
+  pointer replaced by a reference to be relocated when it is loaded
+- the relocations, and the identifiers to be interned
+
+Offset 0 of the blob is reserved, so that a null pointer is saved as 0.
+The blob starts at a 16-byte aligned offset in the file, so it may be
+used wherever the file is loaded or mapped.
+*/
+
+#define PCHVERSION 1
+#define PCHALIGN 16
+
+/* the kind of a relocation is stored in the low bits of its offset */
+enum {
+	RELOCBLOB,   /* offset of an object in the blob */
+	RELOCIDENT,  /* index of an identifier to intern */
+	RELOCEXTERN, /* index of a type defined by the compiler */
+};
+
+struct pchheader {
+	char magic[8];
+	unsigned version;
+	/* sizes of the saved structures, which must match the compiler's */
+	unsigned short sizes[8];
+	unsigned long long textlen, bloblen, nreloc, nident, root;
+};
+
+struct pchobj {
+	struct treenode node;
+	size_t off;
+};
+
+struct pch {
+	struct array blob, relocs, idents, deps;
+	/* offsets of saved objects, strings, and identifiers, by address */
+	void *objs, *strs, *ids;
+};
+
+struct dep {
+	char *path;
+	unsigned long long hash;
+};
+
+struct tag {
+	char *name;
+	struct type *type;
+};
+
+struct root {
+	char *target;
+	char *prefix;
+	struct dep *deps;
+	size_t ndeps;
+	struct decl **decls;
+	size_t ndecls;
+	struct tag *tags;
+	size_t ntags;
+	void *pp, *decl, *emit;
+};
+
+static const char magic[8] = "cprocpch";
+
+static void
+pchinit(struct pchheader *h)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, magic, sizeof(magic));
+	h->version = PCHVERSION;
+	h->sizes[0] = sizeof(void *);
+	h->sizes[1] = sizeof(size_t);
+	h->sizes[2] = sizeof(struct token);
+	h->sizes[3] = sizeof(struct type);
+	h->sizes[4] = sizeof(struct member);
+	h->sizes[5] = sizeof(struct decl);
+	h->sizes[6] = sizeof(struct expr);
+	h->sizes[7] = sizeof(struct root);
+}
+
+/* types defined by the compiler, which are referenced rather than saved */
+static struct type **
+externals(size_t *n)
+{
+	static struct type *ext[] = {
+		&typevoid,
+		&typebool,
+		&typechar, &typeschar, &typeuchar,
+		&typeshort, &typeushort,
+		&typeint, &typeuint,
+		&typelong, &typeulong,
+		&typellong, &typeullong,
+		&typefloat, &typedouble, &typeldouble,
+		&typenullptr,
+		NULL, NULL, NULL,
+	};
+
+	ext[LEN(ext) - 3] = targ->typevalist;
+	ext[LEN(ext) - 2] = targ->typevalist->base;
+	ext[LEN(ext) - 1] = typeadjvalist;
+	*n = LEN(ext);
+	return ext;
+}
+
+/* FNV-1a */
+static unsigned long long
+hashfile(const char *path)
+{
+	unsigned long long h;
+	unsigned char buf[16384];
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	h = FNV1ABASIS;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		h = fnv1a(h, buf, n);
+	if (ferror(f))
+		h = 0;
+	fclose(f);
+	return h;
+}
+
+/* saving */
+
+static size_t
+pchalloc(struct pch *p, size_t size, size_t align)
+{
+	size_t off;
+
+	off = ALIGNUP(p->blob.len, align);
+	if (off > p->blob.len)
+		arrayadd(&p->blob, off - p->blob.len);
+	memset(arrayadd(&p->blob, size), 0, size);
+	return off;
+}
+
+/* get the address of a saved object, valid until the next one is saved */
+void *
+pchat(struct pch *p, size_t off)
+{
+	return (char *)p->blob.val + off;
+}
+
+/*
+Save the object of the given size at obj, or zeroed space if obj is
+NULL, and return its offset. An object is only saved once; new is set
+if this is the first time. Any pointers within the object must be
+replaced using the functions below.
+*/
+size_t
+pchobj(struct pch *p, const void *obj, size_t size, bool *new)
+{
+	struct pchobj *o;
+
+	if (obj) {
+		o = treeinsert(&p->objs, (uintptr_t)obj, sizeof(*o));
+		if (new)
+			*new = o->node.new;
+		if (!o->node.new)
+			return o->off;
+		o->off = pchalloc(p, size, PCHALIGN);
+		memcpy(pchat(p, o->off), obj, size);
+		return o->off;
+	}
+	if (new)
+		*new = true;
+	return pchalloc(p, size, PCHALIGN);
+}
+
+static void
+pchset(struct pch *p, size_t slot, int kind, size_t val)
+{
+	void *ptr;
+
+	/* pointers are aligned, leaving the low bits of their offset for the kind */
+	assert(!(slot & 3));
+	ptr = (void *)val;
+	memcpy(pchat(p, slot), &ptr, sizeof(ptr));
+	if (kind != RELOCBLOB || val)
+		*(size_t *)arrayadd(&p->relocs, sizeof(size_t)) = slot | kind;
+}
+
+/* set the pointer at slot to the saved object at off, or NULL if off is 0 */
+void
+pchptr(struct pch *p, size_t slot, size_t off)
+{
+	pchset(p, slot, RELOCBLOB, off);
+}
+
+/* save a string, and set the pointer at slot to it */
+void
+pchstr(struct pch *p, size_t slot, const char *s)
+{
+	struct pchobj *o;
+	size_t len;
+
+	if (!s) {
+		pchptr(p, slot, 0);
+		return;
+	}
+	o = treeinsert(&p->strs, (uintptr_t)s, sizeof(*o));
+	if (o->node.new) {
+		len = strlen(s) + 1;
+		o->off = pchalloc(p, len, 1);
+		memcpy(pchat(p, o->off), s, len);
+	}
+	pchptr(p, slot, o->off);
+}
+
+/* save a string to be interned when it is loaded, and set the pointer at slot to it */
+void
+pchident(struct pch *p, size_t slot, const char *s)
+{
+	struct pchobj *o;
+	size_t len, off;
+
+	if (!s) {
+		pchptr(p, slot, 0);
+		return;
+	}
+	o = treeinsert(&p->ids, (uintptr_t)s, sizeof(*o));
+	if (o->node.new) {
+		len = strlen(s) + 1;
+		off = pchalloc(p, len, 1);
+		memcpy(pchat(p, off), s, len);
+		o->off = p->idents.len / sizeof(size_t);
+		*(size_t *)arrayadd(&p->idents, sizeof(size_t)) = off;
+	}
+	/* the index of the identifier, rather than its offset */
+	pchset(p, slot, RELOCIDENT, o->off);
+}
+
+static void
+pchexpr(struct pch *p, size_t slot, struct expr *e)
+{
+	size_t off;
+	bool new;
+
+	/* only constant array lengths are needed outside of a function */
+	if (!e || e->kind != EXPRCONST) {
+		pchptr(p, slot, 0);
+		return;
+	}
+	off = pchobj(p, e, sizeof(*e), &new);
+	pchptr(p, slot, off);
+	if (!new)
+		return;
+	pchtype(p, off + offsetof(struct expr, type), e->type);
+	pchptr(p, off + offsetof(struct expr, base), 0);
+	pchptr(p, off + offsetof(struct expr, next), 0);
+	pchptr(p, off + offsetof(struct expr, toeval), 0);
+}
+
+/* save a type and everything it refers to, and set the pointer at slot to it */
+void
+pchtype(struct pch *p, size_t slot, struct type *t)
+{
+	struct type **ext;
+	struct member *m;
+	size_t i, n, off;
+	bool new;
+
+	if (!t) {
+		pchptr(p, slot, 0);
+		return;
+	}
+	ext = externals(&n);
+	for (i = 0; i < n; ++i) {
+		if (ext[i] == t) {
+			pchset(p, slot, RELOCEXTERN, i);
+			return;
+		}
+	}
+	off = pchobj(p, t, sizeof(*t), &new);
+	pchptr(p, slot, off);
+	if (!new)
+		return;
+	emitsavevalue(p, off + offsetof(struct type, value), t->value);
+	pchptr(p, off + offsetof(struct type, link.prev), 0);
+	pchptr(p, off + offsetof(struct type, link.next), 0);
+	switch (t->kind) {
+	case TYPEPOINTER:
+	case TYPEENUM:
+		pchtype(p, off + offsetof(struct type, base), t->base);
+		break;
+	case TYPEARRAY:
+		pchtype(p, off + offsetof(struct type, base), t->base);
+		pchexpr(p, off + offsetof(struct type, u.array.length), t->u.array.length);
+		/* the size of a variable length array is computed by each function */
+		pchptr(p, off + offsetof(struct type, u.array.size), 0);
+		break;
+	case TYPEFUNC:
+		pchtype(p, off + offsetof(struct type, base), t->base);
+		pchdecl(p, off + offsetof(struct type, u.func.params), t->u.func.params);
+		break;
+	case TYPESTRUCT:
+	case TYPEUNION:
+		pchptr(p, off + offsetof(struct type, base), 0);
+		pchident(p, off + offsetof(struct type, u.structunion.tag), t->u.structunion.tag);
+		slot = off + offsetof(struct type, u.structunion.members);
+		for (m = t->u.structunion.members; m; m = m->next) {
+			off = pchobj(p, m, sizeof(*m), NULL);
+			pchptr(p, slot, off);
+			pchident(p, off + offsetof(struct member, name), m->name);
+			pchtype(p, off + offsetof(struct member, type), m->type);
+			slot = off + offsetof(struct member, next);
+		}
+		pchptr(p, slot, 0);
+		break;
+	default:
+		pchptr(p, off + offsetof(struct type, base), 0);
+	}
+}
+
+/* save a list of declarations, and set the pointer at slot to the first */
+void
+pchdecl(struct pch *p, size_t slot, struct decl *d)
+{
+	size_t off;
+	bool new;
+
+	for (; d; d = d->next) {
+		off = pchobj(p, d, sizeof(*d), &new);
+		pchptr(p, slot, off);
+		if (!new)
+			return;
+		pchident(p, off + offsetof(struct decl, name), d->name);
+		pchtype(p, off + offsetof(struct decl, type), d->type);
+		/* the value of a parameter is only valid within its function */
+		if (d->kind == DECLOBJECT && d->u.obj.storage == SDAUTO)
+			pchptr(p, off + offsetof(struct decl, value), 0);
+		else
+			emitsavevalue(p, off + offsetof(struct decl, value), d->value);
+		pchstr(p, off + offsetof(struct decl, asmname), d->asmname);
+		slot = off + offsetof(struct decl, next);
+	}
+	pchptr(p, slot, 0);
+}
+
+/* record a file read while the precompiled header was built */
+void
+pchfile(struct pch *p, const char *path)
+{
+	struct dep *dep;
+
+	dep = arrayadd(&p->deps, sizeof(*dep));
+	dep->path = (char *)path;
+	dep->hash = hashfile(path);
+}
+
+/* start writing a precompiled header to standard output, before the prefix is read */
+void
+pchcreate(void)
+{
+	struct pchheader h;
+
+	memset(&h, 0, sizeof(h));
+	if (fwrite(&h, sizeof(h), 1, stdout) != 1)
+		fatal("write failed");
+}
+
+/* finish the precompiled header once the prefix has been read */
+void
+pchsave(const char *prefix)
+{
+	static const char pad[PCHALIGN];
+	struct pch p = {0};
+	struct pchheader h;
+	struct root *r;
+	struct dep *dep;
+	struct binding *b;
+	struct decl *d;
+	size_t root, off;
+	long pos;
+
+	/* reserve offset 0 for NULL */
+	pchalloc(&p, PCHALIGN, 1);
+	root = pchobj(&p, NULL, sizeof(*r), NULL);
+	pchstr(&p, root + offsetof(struct root, target), targ->name);
+	pchstr(&p, root + offsetof(struct root, prefix), prefix);
+	pchptr(&p, root + offsetof(struct root, pp), ppsave(&p));
+	pchptr(&p, root + offsetof(struct root, decl), declsave(&p));
+	pchptr(&p, root + offsetof(struct root, emit), emitsave(&p));
+
+	/* the builtins are declared by every translation unit */
+	for (b = filescope.decls; b; b = b->next) {
+		if (b->u.decl->kind != DECLBUILTIN)
+			++((struct root *)pchat(&p, root))->ndecls;
+	}
+	off = pchobj(&p, NULL, ((struct root *)pchat(&p, root))->ndecls * sizeof(d), NULL);
+	pchptr(&p, root + offsetof(struct root, decls), off);
+	for (b = filescope.decls; b; b = b->next) {
+		d = b->u.decl;
+		if (d->kind != DECLBUILTIN) {
+			pchdecl(&p, off, d);
+			off += sizeof(d);
+		}
+	}
+
+	for (b = filescope.tags; b; b = b->next)
+		++((struct root *)pchat(&p, root))->ntags;
+	off = pchobj(&p, NULL, ((struct root *)pchat(&p, root))->ntags * sizeof(struct tag), NULL);
+	pchptr(&p, root + offsetof(struct root, tags), off);
+	for (b = filescope.tags; b; b = b->next) {
+		pchident(&p, off + offsetof(struct tag, name), b->name);
+		pchtype(&p, off + offsetof(struct tag, type), b->u.tag);
+		off += sizeof(struct tag);
+	}
+
+	/* the files are recorded last, since the modules add to them */
+	off = pchobj(&p, NULL, p.deps.len, NULL);
+	((struct root *)pchat(&p, root))->ndeps = p.deps.len / sizeof(*dep);
+	pchptr(&p, root + offsetof(struct root, deps), off);
+	arrayforeach (&p.deps, dep) {
+		pchstr(&p, off + offsetof(struct dep, path), dep->path);
+		((struct dep *)pchat(&p, off))->hash = dep->hash;
+		off += sizeof(*dep);
+	}
+
+	fflush(stdout);
+	pos = ftell(stdout);
+	if (pos < 0)
+		fatal("ftell:");
+	pchinit(&h);
+	h.textlen = pos - sizeof(h);
+	h.bloblen = ALIGNUP(p.blob.len, PCHALIGN);
+	h.nreloc = p.relocs.len / sizeof(size_t);
+	h.nident = p.idents.len / sizeof(size_t);
+	h.root = root;
+	pchalloc(&p, h.bloblen - p.blob.len, 1);
+	fwrite(pad, 1, ALIGNUP(pos, PCHALIGN) - pos, stdout);
+	fwrite(p.blob.val, 1, p.blob.len, stdout);
+	fwrite(p.relocs.val, 1, p.relocs.len, stdout);
+	fwrite(p.idents.val, 1, p.idents.len, stdout);
+	if (fseek(stdout, 0, SEEK_SET) != 0)
+		fatal("seek precompiled header:");
+	fwrite(&h, sizeof(h), 1, stdout);
+}
+
+/* loading */
+
+static void
+readall(FILE *f, const char *path, void *buf, size_t len)
+{
+	if (fread(buf, 1, len, f) != len)
+		fatal("read %s: %s", path, ferror(f) ? "read error" : "unexpected end of file");
+}
+
+/*
+Load the precompiled header at path into the state of the translation
+unit, and copy its QBE to standard output. It is an error if it was
+built for a different target, or if any file it was built from has
+changed.
+*/
+void
+pchload(const char *path)
+{
+	struct pchheader h, want;
+	struct type **ext;
+	struct root *r;
+	struct dep *dep;
+	struct decl **d;
+	struct tag *tag;
+	size_t i, n, off, *reloc, *ident;
+	char *blob, buf[16384];
+	void *ptr;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		fatal("open %s:", path);
+	pchinit(&want);
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, want.magic, sizeof(h.magic)) != 0)
+		fatal("%s: not a precompiled header", path);
+	if (h.version != want.version || memcmp(h.sizes, want.sizes, sizeof(h.sizes)) != 0)
+		fatal("%s: precompiled header was built by a different version of the compiler", path);
+	if (fseek(f, ALIGNUP(sizeof(h) + h.textlen, PCHALIGN), SEEK_SET) != 0)
+		fatal("seek %s:", path);
+	blob = xmalloc(h.bloblen);
+	reloc = xreallocarray(NULL, h.nreloc, sizeof(*reloc));
+	ident = xreallocarray(NULL, h.nident, sizeof(*ident));
+	readall(f, path, blob, h.bloblen);
+	readall(f, path, reloc, h.nreloc * sizeof(*reloc));
+	readall(f, path, ident, h.nident * sizeof(*ident));
+
+	/* each identifier is interned once, however many times it is referenced */
+	for (i = 0; i < h.nident; ++i)
+		ident[i] = (uintptr_t)intern(blob + ident[i], strlen(blob + ident[i]));
+	ext = externals(&n);
+	for (i = 0; i < h.nreloc; ++i) {
+		off = reloc[i] & ~(size_t)3;
+		memcpy(&ptr, blob + off, sizeof(ptr));
+		switch (reloc[i] & 3) {
+		case RELOCBLOB:   ptr = blob + (uintptr_t)ptr; break;
+		case RELOCIDENT:  ptr = (char *)ident[(uintptr_t)ptr]; break;
+		case RELOCEXTERN: ptr = ext[(uintptr_t)ptr]; break;
+		}
+		memcpy(blob + off, &ptr, sizeof(ptr));
+	}
+	free(reloc);
+	free(ident);
+
+	r = (struct root *)(blob + h.root);
+	if (strcmp(r->target, targ->name) != 0)
+		fatal("%s: precompiled header was built for target '%s'", path, r->target);
+	for (dep = r->deps; dep < r->deps + r->ndeps; ++dep) {
+		if (hashfile(dep->path) != dep->hash)
+			fatal("%s: precompiled header is out of date: '%s' has changed", path, dep->path);
+	}
+	ppload(r->pp, r->prefix);
+	declload(r->decl);
+	emitload(r->emit);
+	for (d = r->decls; d < r->decls + r->ndecls; ++d)
+		scopeputdecl(&filescope, *d);
+	for (tag = r->tags; tag < r->tags + r->ntags; ++tag)
+		scopeputtag(&filescope, tag->name, tag->type);
+
+	if (fseek(f, sizeof(h), SEEK_SET) != 0)
+		fatal("seek %s:", path);
+	for (; h.textlen > 0; h.textlen -= n) {
+		n = h.textlen < sizeof(buf) ? h.textlen : sizeof(buf);
+		readall(f, path, buf, n);
+		fwrite(buf, 1, n, stdout);
+		if (includereport)
+			reportadd(REPORTBYTES, n);
+	}
+	fclose(f);
+}
@@ -1,28 +1,54 @@
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "util.h"
 #include "cc.h"
 
+/* limit on the depth of nested #include directives */
+#define MAXINCLUDE 200
+
 struct macroparam {
 	char *name;
 	enum {
 		PARAMTOK = 1<<0,  /* the parameter is used normally */
 		PARAMSTR = 1<<1,  /* the parameter is used with the '#' operator */
 		PARAMVAR = 1<<2,  /* the parameter is __VA_ARGS__ */
+		PARAMRAW = 1<<3,  /* the parameter is an operand of the '##' operator */
 	} flags;
 };
 
 struct macroarg {
+	/* macro-expanded argument, the same as raw if nothing was replaced */
 	struct token *token;
 	size_t ntoken;
+	/* argument as written */
+	struct token *raw;
+	size_t nraw;
 	/* stringized argument */
 	struct token str;
 };
 
+/* storage for a macro invocation, kept for reuse once the invocation ends */
+struct invocation {
+	/* arguments of function-like macro invocation */
+	struct macroarg *arg;
+	size_t narg;
+	/* tokens that do not lie within a sequence that outlives the invocation */
+	struct array raw, token;
+	/* replacement list, if it was built with token pasting */
+	struct array subst;
+	struct invocation *next;
+};
+
 struct macro {
 	enum {
 		MACROOBJ,
@@ -34,33 +60,670 @@ struct macro {
 	/* parameters of function-like macro */
 	struct macroparam *param;
 	size_t nparam;
-	/* argument tokens of macro invocation */
-	struct macroarg *arg;
 	/* replacement list */
 	struct token *token;
 	size_t ntoken;
+	/*
+	index of the parameter named by each token in the replacement
+	list, or by the operand of a '#' operator, otherwise -1
+	*/
+	size_t *ref;
+	/* whether the replacement list contains the '##' operator */
+	bool paste;
+	/* current invocation */
+	struct invocation *inv;
+	/* whether the macro was loaded from a precompiled header, which owns its storage */
+	bool pch;
+};
+
+/* the resource of an #embed directive, and the tokens of its parameters */
+struct embed {
+	struct location loc;
+	unsigned char *data;
+	size_t len;
+	struct token *prefix, *suffix, *ifempty;
+	size_t nprefix, nsuffix, nifempty;
+	/* the end of the directive, which ends the tokens too */
+	struct token newline;
 };
 
 struct frame {
 	struct token *token;
 	size_t ntoken;
 	struct macro *macro;
+	/* first token of the frame, and whether it is preceded by a space */
+	struct token *start;
+	bool space;
+	/* the resource whose bytes and commas are the tokens of the frame, made as they are read */
+	struct embed *embed;
+};
+
+/* a file that has been searched for by #include or #embed */
+struct header {
+	char *path;
+	/* open stream, if the file was found but not yet included */
+	FILE *file;
+	bool exists;
+	/* whether the file contains #pragma once */
+	bool once;
+	/* translation unit in which the file was last included */
+	unsigned long tu;
+	/* macro guarding the entire contents of the file, if any */
+	char *guard;
+	/* include directory the file was last found in, for #include_next */
+	int kind;
+	size_t dir;
+};
+
+/* a file being read due to #include */
+struct include {
+	struct header *header;
+	/* number of enclosing conditionals when the file was entered */
+	size_t conds;
+	/* state of include guard detection */
+	enum {
+		GUARDSTART,  /* nothing but whitespace yet */
+		GUARDIN,     /* within the #ifndef group */
+		GUARDEND,    /* after the matching #endif */
+		GUARDNONE,   /* the file has no include guard */
+	} guard;
+	char *guardname;
+	/* number of conditionals including the guard's #ifndef */
+	size_t guardcond;
+};
+
+/* statistics about the expansions of a macro, for -m and -M */
+struct macrostat {
+	char *name;
+	unsigned long long count;
+	/* tokens in the replacement lists after argument substitution */
+	unsigned long long tokens;
+	/* deepest nesting of macro expansions at which it was expanded */
+	size_t depth;
+	/* processor time spent reading and replacing the arguments */
+	clock_t time;
+};
+
+/* conditional inclusion directive */
+struct cond {
+	struct location loc;
+	/* whether one of the groups has been included */
+	bool taken;
+	/* whether the #else group has been reached */
+	bool sawelse;
 };
 
 enum ppflags ppflags;
 
 static struct array ctx;
 static struct map macros;
+/* invocations that have ended */
+static struct invocation *freeinv;
 /* number of macros currently undergoing expansion */
 static size_t macrodepth;
+/* size of the context up to the end of the macro argument being replaced, or 0 */
+static size_t argend;
+/* whether the last token scanned was a newline, so a directive may follow */
+static bool newline = true;
+/* whether a directive is being processed, so macro invocations end at a newline */
+static bool indirective;
+/* stack of conditional directives enclosing the current line */
+static struct array conds;
+/* stack of files being included */
+static struct array includes;
+static struct array incdirs[INCAFTER + 1];
+/* headers by path, and results of header searches by header name */
+static struct map headers, searches;
+static unsigned long tu = 1;
+/* directives for the command-line options, and for those along with the predefined macros */
+static struct array options, cmdline;
+/* statistics of each macro by name, and the time spent in outermost function-like invocations */
+static struct map stats;
+static clock_t statstime;
+static size_t statsdepth;
+static struct header cmdlineheader = {.path = "<command line>", .kind = -1};
+/* location of the last token read from a file */
+static struct location srcloc;
+static char *vaargs, *definedname, *filename, *linename;
+/* spellings of the bytes of #embed */
+static char bytelit[256][4];
+/* whether the macros and headers were loaded from a precompiled header */
+static bool loaded;
+
+/*
+Mark the interned spellings of the keywords with their token kind, so
+that recognizing a keyword only takes a lookup of the identifier's
+interned value.
+*/
+static void
+keywordinit(void)
+{
+	static const struct {
+		const char *name;
+		int value;
+	} keywords[] = {
+		{"_Alignas",       TALIGNAS},
+		{"_Alignof",       TALIGNOF},
+		{"_Atomic",        T_ATOMIC},
+		{"_Bool",          TBOOL},
+		{"_Complex",       T_COMPLEX},
+		{"_Decimal128",    T_DECIMAL128},
+		{"_Decimal32",     T_DECIMAL32},
+		{"_Decimal64",     T_DECIMAL64},
+		{"_Generic",       T_GENERIC},
+		{"_Imaginary",     T_IMAGINARY},
+		{"_Noreturn",      T_NORETURN},
+		{"_Static_assert", TSTATIC_ASSERT},
+		{"_Thread_local",  TTHREAD_LOCAL},
+		{"__alignof__",    TALIGNOF},
+		{"__asm",          T__ASM__},
+		{"__asm__",        T__ASM__},
+		{"__attribute__",  T__ATTRIBUTE__},
+		{"__inline",       TINLINE},
+		{"__inline__",     TINLINE},
+		{"__signed",       TSIGNED},
+		{"__signed__",     TSIGNED},
+		{"__thread",       TTHREAD_LOCAL},
+		{"__typeof",       TTYPEOF},
+		{"__typeof__",     TTYPEOF},
+		{"__volatile__",   TVOLATILE},
+		{"alignas",        TALIGNAS},
+		{"alignof",        TALIGNOF},
+		{"auto",           TAUTO},
+		{"bool",           TBOOL},
+		{"break",          TBREAK},
+		{"case",           TCASE},
+		{"char",           TCHAR},
+		{"const",          TCONST},
+		{"constexpr",      TCONSTEXPR},
+		{"continue",       TCONTINUE},
+		{"default",        TDEFAULT},
+		{"do",             TDO},
+		{"double",         TDOUBLE},
+		{"else",           TELSE},
+		{"enum",           TENUM},
+		{"extern",         TEXTERN},
+		{"false",          TFALSE},
+		{"float",          TFLOAT},
+		{"for",            TFOR},
+		{"goto",           TGOTO},
+		{"if",             TIF},
+		{"inline",         TINLINE},
+		{"int",            TINT},
+		{"long",           TLONG},
+		{"nullptr",        TNULLPTR},
+		{"register",       TREGISTER},
+		{"restrict",       TRESTRICT},
+		{"return",         TRETURN},
+		{"short",          TSHORT},
+		{"signed",         TSIGNED},
+		{"sizeof",         TSIZEOF},
+		{"static",         TSTATIC},
+		{"static_assert",  TSTATIC_ASSERT},
+		{"struct",         TSTRUCT},
+		{"switch",         TSWITCH},
+		{"thread_local",   TTHREAD_LOCAL},
+		{"true",           TTRUE},
+		{"typedef",        TTYPEDEF},
+		{"typeof",         TTYPEOF},
+		{"typeof_unqual",  TTYPEOF_UNQUAL},
+		{"union",          TUNION},
+		{"unsigned",       TUNSIGNED},
+		{"void",           TVOID},
+		{"volatile",       TVOLATILE},
+		{"while",          TWHILE},
+	};
+	size_t i;
+
+	for (i = 0; i < LEN(keywords); ++i)
+		*internval(intern(keywords[i].name, strlen(keywords[i].name))) = keywords[i].value;
+}
+
+static void
+predefined(const char *fmt, ...)
+{
+	va_list ap;
+	char buf[256];
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	assert(n >= 0 && n < sizeof(buf));
+	arrayaddbuf(&cmdline, "#define ", 8);
+	arrayaddbuf(&cmdline, buf, n);
+	arrayaddbuf(&cmdline, "\n", 1);
+}
+
+static const char *
+typestr(struct type *t)
+{
+	switch (t->kind) {
+	case TYPESHORT: return t->u.basic.issigned ? "short int" : "short unsigned int";
+	case TYPEINT:   return t->u.basic.issigned ? "int" : "unsigned int";
+	case TYPELONG:  return t->u.basic.issigned ? "long int" : "long unsigned int";
+	case TYPELLONG: return t->u.basic.issigned ? "long long int" : "long long unsigned int";
+	}
+	fatal("internal error: unknown type name");
+	return NULL;  /* unreachable */
+}
+
+/* define the limits of an integer type, as in <limits.h> and <stdint.h> */
+static void
+predefinedlimits(const char *name, struct type *t)
+{
+	static const char *const suffix[][2] = {
+		[TYPECHAR]  = {"", ""},
+		[TYPESHORT] = {"", ""},
+		[TYPEINT]   = {"U", ""},
+		[TYPELONG]  = {"UL", "L"},
+		[TYPELLONG] = {"ULL", "LL"},
+	};
+	int width, issigned;
+
+	width = t->size * CHAR_BIT;
+	issigned = t->u.basic.issigned;
+	predefined("__%s_MAX__ 0x%llx%s", name, 0xffffffffffffffffull >> 64 - width + issigned, suffix[t->kind][issigned]);
+	predefined("__%s_WIDTH__ %d", name, width);
+}
+
+/*
+Define the predefined macros of C11 6.10.8 (besides __FILE__ and
+__LINE__, which are expanded specially), and those describing the
+target that the system headers expect.
+*/
+static void
+predefine(void)
+{
+	static const char *const macros[] = {
+		"__STDC__ 1",
+		"__STDC_VERSION__ 201112L",
+		"__STDC_HOSTED__ 1",
+		"__STDC_UTF_16__ 1",
+		"__STDC_UTF_32__ 1",
+		"__CHAR_BIT__ 8",
+		"__ORDER_LITTLE_ENDIAN__ 1234",
+		"__ORDER_BIG_ENDIAN__ 4321",
+		"__ORDER_PDP_ENDIAN__ 3412",
+		"__BYTE_ORDER__ __ORDER_LITTLE_ENDIAN__",
+		"__FLOAT_WORD_ORDER__ __ORDER_LITTLE_ENDIAN__",
+
+		/* IEEE 754 binary32 and binary64 */
+		"__FLT_RADIX__ 2",
+		"__FLT_EVAL_METHOD__ 0",
+		"__DECIMAL_DIG__ 17",
+		"__FLT_MANT_DIG__ 24",
+		"__FLT_DIG__ 6",
+		"__FLT_DECIMAL_DIG__ 9",
+		"__FLT_MIN_EXP__ (-125)",
+		"__FLT_MIN_10_EXP__ (-37)",
+		"__FLT_MAX_EXP__ 128",
+		"__FLT_MAX_10_EXP__ 38",
+		"__FLT_MAX__ 3.40282346638528859811704183484516925e+38F",
+		"__FLT_MIN__ 1.17549435082228750796873653722224568e-38F",
+		"__FLT_EPSILON__ 1.19209289550781250000000000000000000e-7F",
+		"__FLT_DENORM_MIN__ 1.40129846432481707092372958328991613e-45F",
+		"__FLT_HAS_DENORM__ 1",
+		"__FLT_HAS_INFINITY__ 1",
+		"__FLT_HAS_QUIET_NAN__ 1",
+		"__DBL_MANT_DIG__ 53",
+		"__DBL_DIG__ 15",
+		"__DBL_DECIMAL_DIG__ 17",
+		"__DBL_MIN_EXP__ (-1021)",
+		"__DBL_MIN_10_EXP__ (-307)",
+		"__DBL_MAX_EXP__ 1024",
+		"__DBL_MAX_10_EXP__ 308",
+		"__DBL_MAX__ ((double)1.79769313486231570814527423731704357e+308L)",
+		"__DBL_MIN__ ((double)2.22507385850720138309023271733240406e-308L)",
+		"__DBL_EPSILON__ ((double)2.22044604925031308084726333618164062e-16L)",
+		"__DBL_DENORM_MIN__ ((double)4.94065645841246544176568792868221372e-324L)",
+		"__DBL_HAS_DENORM__ 1",
+		"__DBL_HAS_INFINITY__ 1",
+		"__DBL_HAS_QUIET_NAN__ 1",
+
+		/* long double is not yet supported, and is treated as double */
+		"__LDBL_MANT_DIG__ 53",
+		"__LDBL_DIG__ 15",
+		"__LDBL_DECIMAL_DIG__ 17",
+		"__LDBL_MIN_EXP__ (-1021)",
+		"__LDBL_MIN_10_EXP__ (-307)",
+		"__LDBL_MAX_EXP__ 1024",
+		"__LDBL_MAX_10_EXP__ 308",
+		"__LDBL_MAX__ 1.79769313486231570814527423731704357e+308L",
+		"__LDBL_MIN__ 2.22507385850720138309023271733240406e-308L",
+		"__LDBL_EPSILON__ 2.22044604925031308084726333618164062e-16L",
+		"__LDBL_DENORM_MIN__ 4.94065645841246544176568792868221372e-324L",
+		"__LDBL_HAS_DENORM__ 1",
+		"__LDBL_HAS_INFINITY__ 1",
+		"__LDBL_HAS_QUIET_NAN__ 1",
+	};
+	static const struct {
+		const char *name;
+		struct type *type;
+	} sizes[] = {
+		{"SHORT",       &typeshort},
+		{"INT",         &typeint},
+		{"LONG",        &typelong},
+		{"LONG_LONG",   &typellong},
+		{"FLOAT",       &typefloat},
+		{"DOUBLE",      &typedouble},
+		{"LONG_DOUBLE", &typeldouble},
+		{"SIZE_T",      &typeulong},
+		{"PTRDIFF_T",   &typelong},
+		{"WINT_T",      &typeuint},
+	};
+	struct type *ptr;
+	const char *const *p;
+	size_t i;
+
+	for (i = 0; i < LEN(macros); ++i)
+		predefined("%s", macros[i]);
+	for (p = targ->macros; *p; ++p)
+		predefined("%s", *p);
+	if (!targ->signedchar)
+		predefined("__CHAR_UNSIGNED__ 1");
+
+	ptr = mkpointertype(&typevoid, QUALNONE);
+	if (typelong.size == 8 && ptr->size == 8) {
+		predefined("_LP64 1");
+		predefined("__LP64__ 1");
+	}
+	for (i = 0; i < LEN(sizes); ++i)
+		predefined("__SIZEOF_%s__ %llu", sizes[i].name, sizes[i].type->size);
+	predefined("__SIZEOF_POINTER__ %llu", ptr->size);
+	predefined("__SIZEOF_WCHAR_T__ %llu", targ->typewchar->size);
+
+	predefined("__SIZE_TYPE__ %s", typestr(&typeulong));
+	predefined("__PTRDIFF_TYPE__ %s", typestr(&typelong));
+	predefined("__WCHAR_TYPE__ %s", typestr(targ->typewchar));
+	predefined("__WINT_TYPE__ %s", typestr(&typeuint));
+	predefined("__INTMAX_TYPE__ %s", typestr(&typelong));
+	predefined("__UINTMAX_TYPE__ %s", typestr(&typeulong));
+	predefined("__INTPTR_TYPE__ %s", typestr(&typelong));
+	predefined("__UINTPTR_TYPE__ %s", typestr(&typeulong));
+	predefined("__CHAR16_TYPE__ %s", typestr(&typeushort));
+	predefined("__CHAR32_TYPE__ %s", typestr(&typeuint));
+
+	predefinedlimits("SCHAR", &typeschar);
+	predefinedlimits("SHRT", &typeshort);
+	predefinedlimits("INT", &typeint);
+	predefinedlimits("LONG", &typelong);
+	predefinedlimits("LONG_LONG", &typellong);
+	predefinedlimits("WCHAR", targ->typewchar);
+	predefinedlimits("WINT", &typeuint);
+	predefinedlimits("SIZE", &typeulong);
+	predefinedlimits("PTRDIFF", &typelong);
+	predefinedlimits("INTMAX", &typelong);
+	predefinedlimits("UINTMAX", &typeulong);
+	predefinedlimits("INTPTR", &typelong);
+	predefinedlimits("UINTPTR", &typeulong);
+	predefined("__WCHAR_MIN__ %s", targ->typewchar->u.basic.issigned ? "(-__WCHAR_MAX__ - 1)" : "0U");
+	predefined("__WINT_MIN__ 0U");
+}
+
+/* set up the state shared by all translation units */
+static void
+setup(void)
+{
+	int i;
+
+	if (vaargs)
+		return;
+	vaargs = intern("__VA_ARGS__", 11);
+	definedname = intern("defined", 7);
+	filename = intern("__FILE__", 8);
+	linename = intern("__LINE__", 8);
+	keywordinit();
+	predefine();
+	arrayaddbuf(&cmdline, options.val, options.len);
+	mapinit(&headers, 64);
+	mapinit(&searches, 64);
+	for (i = 0; i < 256; ++i)
+		sprintf(bytelit[i], "%d", i);
+}
 
 void
 ppinit(void)
 {
-	mapinit(&macros, 64);
+	struct include *inc;
+
+	setup();
+	if (loaded) {
+		/* the precompiled header already has the effect of the command line */
+		loaded = false;
+	} else {
+		mapinit(&macros, 64);
+		/* read the predefined macros and command-line options as if they were included */
+		inc = arrayadd(&includes, sizeof(*inc));
+		inc->header = &cmdlineheader;
+		inc->conds = 0;
+		inc->guard = GUARDNONE;
+		scanbuf(cmdlineheader.path, cmdline.val, cmdline.len);
+		if (includereport)
+			reportfile(cmdlineheader.path, REPORTENTER);
+	}
 	next();
 }
 
+/* forget all macros and expansion state before the next translation unit */
+void
+ppreset(void)
+{
+	mapfree(&macros, NULL);
+	ctx.len = 0;
+	conds.len = 0;
+	includes.len = 0;
+	++tu;
+	macrodepth = 0;
+	newline = true;
+}
+
+/* add a directory to be searched for included files */
+void
+ppincdir(enum incdir kind, char *dir)
+{
+	arrayaddptr(&incdirs[kind], dir);
+}
+
+/* define a macro for every translation unit, given as name or name=value */
+void
+ppdefine(const char *def)
+{
+	const char *eq;
+
+	arrayaddbuf(&options, "#define ", 8);
+	eq = strchr(def, '=');
+	if (eq) {
+		arrayaddbuf(&options, def, eq - def);
+		arrayaddbuf(&options, " ", 1);
+		arrayaddbuf(&options, eq + 1, strlen(eq + 1));
+	} else {
+		arrayaddbuf(&options, def, strlen(def));
+		arrayaddbuf(&options, " 1", 2);
+	}
+	arrayaddbuf(&options, "\n", 1);
+}
+
+/* undefine a predefined macro, or one defined by an earlier ppdefine() */
+void
+ppundef(const char *name)
+{
+	arrayaddbuf(&options, "#undef ", 7);
+	arrayaddbuf(&options, name, strlen(name));
+	arrayaddbuf(&options, "\n", 1);
+}
+
+/* include a file before the start of every translation unit */
+void
+ppinclude(const char *name)
+{
+	arrayaddbuf(&options, "#include \"", 10);
+	arrayaddbuf(&options, name, strlen(name));
+	arrayaddbuf(&options, "\"\n", 2);
+}
+
+/* the state of the preprocessor after reading the prefix of a precompiled header */
+struct ppstate {
+	/* include directories and command-line options, including the prefix */
+	char *options;
+	struct macro **macros;
+	size_t nmacros;
+	/* headers included by the prefix */
+	struct header *headers;
+	size_t nheaders;
+};
+
+/* describe the options that a precompiled header must be used with */
+static void
+ppoptions(struct array *buf)
+{
+	enum incdir kind;
+	char **dir;
+
+	for (kind = 0; kind <= INCAFTER; ++kind) {
+		arrayforeach (&incdirs[kind], dir) {
+			arrayaddbuf(buf, &"QISA"[kind], 1);
+			arrayaddbuf(buf, *dir, strlen(*dir));
+			arrayaddbuf(buf, "\n", 1);
+		}
+	}
+	arrayaddbuf(buf, options.val, options.len);
+}
+
+static void
+macrosave(struct pch *p, size_t slot, struct macro *m)
+{
+	size_t off, i, n;
+
+	off = pchobj(p, m, sizeof(*m), NULL);
+	pchptr(p, slot, off);
+	((struct macro *)pchat(p, off))->pch = true;
+	pchident(p, off + offsetof(struct macro, name), m->name);
+	pchptr(p, off + offsetof(struct macro, inv), 0);
+	n = 0;
+	if (m->param)
+		n = pchobj(p, m->param, m->nparam * sizeof(m->param[0]), NULL);
+	pchptr(p, off + offsetof(struct macro, param), n);
+	for (i = 0; i < m->nparam; ++i)
+		pchident(p, n + i * sizeof(m->param[0]) + offsetof(struct macroparam, name), m->param[i].name);
+	n = pchobj(p, m->token, m->ntoken * sizeof(m->token[0]), NULL);
+	pchptr(p, off + offsetof(struct macro, token), n);
+	for (i = 0; i < m->ntoken; ++i, n += sizeof(m->token[0])) {
+		if (m->token[i].kind == TIDENT)
+			pchident(p, n + offsetof(struct token, lit), m->token[i].lit);
+		else
+			pchstr(p, n + offsetof(struct token, lit), m->token[i].lit);
+		pchstr(p, n + offsetof(struct token, loc.file), m->token[i].loc.file);
+	}
+	n = 0;
+	if (m->ref)
+		n = pchobj(p, m->ref, m->ntoken * sizeof(m->ref[0]), NULL);
+	pchptr(p, off + offsetof(struct macro, ref), n);
+}
+
+/* save the macros, and the headers included by the prefix */
+size_t
+ppsave(struct pch *p)
+{
+	static struct array buf;
+	struct header *h;
+	size_t off, slot, i, n;
+
+	off = pchobj(p, NULL, sizeof(struct ppstate), NULL);
+	/* the buffer is not freed, since saved strings are found by address */
+	ppoptions(&buf);
+	arrayaddbuf(&buf, "", 1);
+	pchstr(p, off + offsetof(struct ppstate, options), buf.val);
+
+	n = 0;
+	for (i = 0; i < macros.cap; ++i) {
+		if (macros.keys[i].str && macros.vals[i])
+			++n;
+	}
+	slot = pchobj(p, NULL, n * sizeof(struct macro *), NULL);
+	pchptr(p, off + offsetof(struct ppstate, macros), slot);
+	((struct ppstate *)pchat(p, off))->nmacros = n;
+	for (i = 0; i < macros.cap; ++i) {
+		if (macros.keys[i].str && macros.vals[i]) {
+			macrosave(p, slot, macros.vals[i]);
+			slot += sizeof(struct macro *);
+		}
+	}
+
+	n = 0;
+	for (i = 0; i < headers.cap; ++i) {
+		h = headers.keys[i].str ? headers.vals[i] : NULL;
+		if (h && h->tu == tu)
+			++n;
+	}
+	slot = pchobj(p, NULL, n * sizeof(*h), NULL);
+	pchptr(p, off + offsetof(struct ppstate, headers), slot);
+	((struct ppstate *)pchat(p, off))->nheaders = n;
+	for (i = 0; i < headers.cap; ++i) {
+		h = headers.keys[i].str ? headers.vals[i] : NULL;
+		if (!h || h->tu != tu)
+			continue;
+		memcpy(pchat(p, slot), h, sizeof(*h));
+		pchstr(p, slot + offsetof(struct header, path), h->path);
+		pchptr(p, slot + offsetof(struct header, file), 0);
+		pchident(p, slot + offsetof(struct header, guard), h->guard);
+		pchfile(p, h->path);
+		slot += sizeof(*h);
+	}
+	return off;
+}
+
+/*
+Load the macros and headers saved by ppsave for the next translation
+unit, in place of the predefined macros and command-line options.
+*/
+void
+ppload(void *state, const char *prefix)
+{
+	static struct array buf;
+	struct ppstate *st = state;
+	struct header *h, *saved;
+	struct mapkey k;
+	size_t i, cap;
+
+	setup();
+	buf.len = 0;
+	ppoptions(&buf);
+	arrayaddbuf(&buf, "#include \"", 10);
+	arrayaddbuf(&buf, prefix, strlen(prefix));
+	arrayaddbuf(&buf, "\"\n", 3);
+	if (strcmp(buf.val, st->options) != 0)
+		fatal("precompiled header for '%s' was built with different options", prefix);
+
+	for (cap = 64; cap / 2 < st->nmacros; cap *= 2)
+		;
+	mapinit(&macros, cap);
+	for (i = 0; i < st->nmacros; ++i) {
+		internkey(&k, st->macros[i]->name);
+		*mapput(&macros, &k) = st->macros[i];
+	}
+	for (saved = st->headers; saved < st->headers + st->nheaders; ++saved) {
+		mapkey(&k, saved->path, strlen(saved->path));
+		h = mapget(&headers, &k);
+		if (!h) {
+			/* the header outlives the precompiled header, so it needs its own path */
+			h = xmalloc(sizeof(*h));
+			h->path = xmalloc(k.len + 1);
+			memcpy(h->path, saved->path, k.len + 1);
+			h->file = NULL;
+			h->kind = saved->kind;
+			h->dir = saved->dir;
+			k.str = h->path;
+			*mapput(&headers, &k) = h;
+		}
+		h->exists = true;
+		h->once = saved->once;
+		h->guard = saved->guard;
+		h->tu = tu;
+	}
+	loaded = true;
+}
+
 /* check if two macro definitions are equal, as in C11 6.10.3p2 */
 static bool
 macroequal(struct macro *m1, struct macro *m2)
@@ -74,7 +737,7 @@ macroequal(struct macro *m1, struct macro *m2)
 		if (m1->nparam != m2->nparam)
 			return false;
 		for (p1 = m1->param, p2 = m2->param; p1 < m1->param + m1->nparam; ++p1, ++p2) {
-			if (strcmp(p1->name, p2->name) != 0 || p1->flags != p2->flags)
+			if (p1->name != p2->name || p1->flags != p2->flags)
 				return false;
 		}
 	}
@@ -97,7 +760,7 @@ macroparam(struct macro *m, struct token *t)
 
 	if (t->kind == TIDENT) {
 		for (i = 0; i < m->nparam; ++i) {
-			if (strcmp(m->param[i].name, t->lit) == 0)
+			if (m->param[i].name == t->lit)
 				return i;
 		}
 	}
@@ -110,17 +773,41 @@ macroget(char *name)
 {
 	struct mapkey k;
 
-	mapkey(&k, name, strlen(name));
+	internkey(&k, name);
 	return mapget(&macros, &k);
 }
 
+/* get storage for a macro invocation with n arguments */
+static struct invocation *
+invocation(size_t n)
+{
+	struct invocation *inv;
+
+	inv = freeinv;
+	if (inv) {
+		freeinv = inv->next;
+	} else {
+		inv = xmalloc(sizeof(*inv));
+		*inv = (struct invocation){0};
+	}
+	if (n > inv->narg) {
+		inv->arg = xreallocarray(inv->arg, n, sizeof(inv->arg[0]));
+		inv->narg = n;
+	}
+	inv->raw.len = 0;
+	inv->token.len = 0;
+	inv->subst.len = 0;
+	return inv;
+}
+
 static void
 macrodone(struct macro *m)
 {
 	m->hide = false;
-	if (m->kind == MACROFUNC && m->nparam > 0) {
-		free(m->arg[0].token);
-		free(m->arg);
+	if (m->inv) {
+		m->inv->next = freeinv;
+		freeinv = m->inv;
+		m->inv = NULL;
 	}
 	--macrodepth;
 }
@@ -131,6 +818,13 @@ macrovarargs(struct macro *m)
 	return m->kind == MACROFUNC && m->nparam > 0 && m->param[m->nparam - 1].flags & PARAMVAR;
 }
 
+/* whether parameters are substituted as the frame is read, rather than in advance */
+static bool
+framelazy(struct frame *f)
+{
+	return f->macro && f->macro->ref && !f->macro->paste;
+}
+
 static struct token *
 framenext(struct frame *f)
 {
@@ -147,18 +841,39 @@ ctxpush(struct token *t, size_t n, struct macro *m, bool space)
 	f->token = t;
 	f->ntoken = n;
 	f->macro = m;
-	if (n > 0)
-		t[0].space = space;
+	f->start = t;
+	f->space = space;
+	f->embed = NULL;
 	return f;
 }
 
-/* get the next token from the context */
-static struct token *
-ctxnext(void)
+/* make the next token of an #embed frame, alternating between its bytes and commas */
+static void
+embednext(struct frame *f, struct token *t)
+{
+	struct embed *e = f->embed;
+	size_t i;
+
+	i = 2 * e->len - 1 - f->ntoken--;
+	t->loc = e->loc;
+	t->hide = false;
+	t->space = i == 0 && f->space;
+	if (i % 2) {
+		t->kind = TCOMMA;
+		t->lit = NULL;
+	} else {
+		t->kind = TNUMBER;
+		t->lit = bytelit[e->data[i / 2]];
+	}
+}
+
+/* get the next token from the context into t */
+static bool
+ctxnext(struct token *t)
 {
 	struct frame *f;
-	struct token *t;
 	struct macro *m;
+	struct macroarg *arg;
 	bool space;
 	size_t i;
 
@@ -170,40 +885,36 @@ again:
 			macrodone(f->macro);
 	}
 	if (ctx.len == 0)
-		return NULL;
+		return false;
+	if (f->embed) {
+		embednext(f, t);
+		return true;
+	}
 	m = f->macro;
-	if (m && m->kind == MACROFUNC) {
-		/* try to expand macro parameter */
-		space = f->token->space;
-		switch (f->token->kind) {
-		case THASH:
-			framenext(f);
-			t = framenext(f);
-			assert(t);
-			i = macroparam(m, t);
-			assert(i != -1);
-			f = ctxpush(&m->arg[i].str, 1, NULL, space);
-			break;
-		case TIDENT:
-			i = macroparam(m, f->token);
-			if (i == -1)
-				break;
+	if (framelazy(f) && (i = m->ref[f->token - m->token]) != -1) {
+		/* expand macro parameter */
+		space = f->token == f->start ? f->space : f->token->space;
+		arg = &m->inv->arg[i];
+		if (framenext(f)->kind == THASH) {
 			framenext(f);
-			if (m->arg[i].ntoken == 0)
+			f = ctxpush(&arg->str, 1, NULL, space);
+		} else {
+			if (arg->ntoken == 0)
 				goto again;
-			f = ctxpush(m->arg[i].token, m->arg[i].ntoken, NULL, space);
-			break;
+			f = ctxpush(arg->token, arg->ntoken, NULL, space);
 		}
-		/* XXX: token concatenation */
 	}
-	return framenext(f);
+	*t = *f->token;
+	if (f->token == f->start)
+		t->space = f->space;
+	framenext(f);
+	return true;
 }
 
 static void
 define(void)
 {
-	struct token *t;
-	enum tokenkind prev;
+	struct token *t, *end;
 	struct macro *m;
 	struct macroparam *p;
 	struct array params = {0}, repl = {0};
@@ -221,6 +932,11 @@ define(void)
 		/* read macro parameter names */
 		p = NULL;
 		while (scan(&tok), tok.kind != TRPAREN) {
+			if (p && !(p->flags & PARAMVAR) && tok.kind == TELLIPSIS) {
+				/* GNU extension: a named variable argument parameter */
+				p->flags |= PARAMVAR;
+				continue;
+			}
 			if (p) {
 				if (p->flags & PARAMVAR)
 					tokencheck(&tok, TRPAREN, "after '...'");
@@ -230,7 +946,7 @@ define(void)
 			p = arrayadd(&params, sizeof(*p));
 			p->flags = 0;
 			if (tok.kind == TELLIPSIS) {
-				p->name = "__VA_ARGS__";
+				p->name = vaargs;
 				p->flags |= PARAMVAR;
 			} else {
 				p->name = tokencheck(&tok, TIDENT, "of macro parameter name or '...'");
@@ -242,35 +958,58 @@ define(void)
 	}
 	m->param = params.val;
 	m->nparam = params.len / sizeof(m->param[0]);
+	m->paste = false;
+	m->inv = NULL;
+	m->pch = false;
 
 	/* read macro body */
-	i = macroparam(m, t);
 	while (t->kind != TNEWLINE && t->kind != TEOF) {
-		if (t->kind == THASHHASH)
-			error(&t->loc, "'##' operator is not yet implemented");
-		prev = t->kind;
+		if (t->kind == TIDENT && t->lit == vaargs && !macrovarargs(m))
+			error(&t->loc, "__VA_ARGS__ can only be used in variadic function-like macros");
 		t = arrayadd(&repl, sizeof(*t));
 		scan(t);
-		if (t->kind == TIDENT && strcmp(t->lit, "__VA_ARGS__") == 0 && !macrovarargs(m))
-			error(&t->loc, "__VA_ARGS__ can only be used in variadic function-like macros");
+	}
+	m->token = repl.val;
+	m->ntoken = repl.len / sizeof(*t) - 1;
+	tok = *t;
+
+	/* find out how each parameter is used */
+	m->ref = NULL;
+	if (m->nparam > 0 && m->ntoken > 0)
+		m->ref = xreallocarray(NULL, m->ntoken, sizeof(m->ref[0]));
+	for (t = m->token, end = t + m->ntoken; t < end; ++t) {
+		if (m->ref)
+			m->ref[t - m->token] = -1;
+		if (t->kind == THASHHASH) {
+			if (t == m->token || t + 1 == end)
+				error(&t->loc, "'##' cannot appear at either end of a macro replacement list");
+			m->paste = true;
+			continue;
+		}
 		if (m->kind != MACROFUNC)
 			continue;
-		if (i != -1)
-			m->param[i].flags |= PARAMTOK;
-		i = macroparam(m, t);
-		if (prev == THASH) {
+		if (t->kind == THASH) {
+			++t;
 			tokencheck(t, TIDENT, "after '#' operator");
+			i = macroparam(m, t);
 			if (i == -1)
 				error(&t->loc, "'%s' is not a macro parameter name", t->lit);
 			m->param[i].flags |= PARAMSTR;
-			i = -1;
+			m->ref[t - m->token - 1] = i;
+			m->ref[t - m->token] = i;
+			continue;
 		}
+		i = macroparam(m, t);
+		if (i == -1)
+			continue;
+		m->ref[t - m->token] = i;
+		if (t > m->token && t[-1].kind == THASHHASH || t + 1 < end && t[1].kind == THASHHASH)
+			m->param[i].flags |= PARAMRAW;
+		else
+			m->param[i].flags |= PARAMTOK;
 	}
-	m->token = repl.val;
-	m->ntoken = repl.len / sizeof(*t) - 1;
-	tok = *t;
 
-	mapkey(&k, m->name, strlen(m->name));
+	internkey(&k, m->name);
 	entry = mapput(&macros, &k);
 	if (*entry && !macroequal(m, *entry))
 		error(&tok.loc, "redefinition of macro '%s'", m->name);
@@ -286,45 +1025,767 @@ undef(void)
 	struct macro *m;
 
 	name = tokencheck(&tok, TIDENT, "after #undef");
-	mapkey(&k, name, strlen(name));
+	internkey(&k, name);
 	entry = mapput(&macros, &k);
 	m = *entry;
 	if (m) {
-		free(name);
-		free(m->param);
-		free(m->token);
+		if (!m->pch) {
+			free(m->param);
+			free(m->token);
+			free(m->ref);
+		}
 		*entry = NULL;
 	}
 	scan(&tok);
 }
 
+static void rawnext(struct token *);
+
+/* 6.10.1 Conditional inclusion */
+
+static uintmax_t ifcond(bool *, bool);
+
+/* binding strength of a binary operator in a #if expression, or 0 */
+static int
+ifprec(enum tokenkind kind)
+{
+	switch (kind) {
+	case TMUL: case TDIV: case TMOD: return 10;
+	case TADD: case TSUB:            return 9;
+	case TSHL: case TSHR:            return 8;
+	case TLESS: case TGREATER:
+	case TLEQ: case TGEQ:            return 7;
+	case TEQL: case TNEQ:            return 6;
+	case TBAND:                      return 5;
+	case TXOR:                       return 4;
+	case TBOR:                       return 3;
+	case TLAND:                      return 2;
+	case TLOR:                       return 1;
+	}
+	return 0;
+}
+
+static uintmax_t
+ifnumber(bool *u)
+{
+	uintmax_t v;
+	char *src, *end;
+	int base;
+
+	src = tok.lit;
+	if (src[0] == '0') {
+		switch (src[1]) {
+		case 'x': case 'X': base = 16; src += 2; break;
+		case 'b': case 'B': base = 2; src += 2; break;
+		default: base = 8; break;
+		}
+	} else {
+		base = 10;
+	}
+	errno = 0;
+	v = strtoumax(src, &end, base);
+	if (end == src && base != 8 || strpbrk(end, base == 16 ? ".pP" : ".eE"))
+		error(&tok.loc, "invalid integer constant '%s' in #if", tok.lit);
+	if (errno)
+		error(&tok.loc, "integer constant '%s' is too large", tok.lit);
+	*u = v > INTMAX_MAX;
+	for (; *end; ++end) {
+		switch (*end) {
+		case 'u': case 'U': *u = true; break;
+		case 'l': case 'L': break;
+		default: error(&tok.loc, "invalid integer constant suffix '%s'", end);
+		}
+	}
+	return v;
+}
+
+static uintmax_t
+ifunary(bool *u, bool eval)
+{
+	struct token t;
+	struct type *type;
+	uintmax_t v;
+	bool paren;
+
+	*u = false;
+	switch (tok.kind) {
+	case TLPAREN:
+		next();
+		v = ifcond(u, eval);
+		expect(TRPAREN, "after expression");
+		return v;
+	case TADD:
+		next();
+		return ifunary(u, eval);
+	case TSUB:
+		next();
+		return -ifunary(u, eval);
+	case TBNOT:
+		next();
+		return ~ifunary(u, eval);
+	case TLNOT:
+		next();
+		v = ifunary(u, eval);
+		*u = false;
+		return !v;
+	case TNUMBER:
+		v = ifnumber(u);
+		break;
+	case TCHARCONST:
+		v = charvalue(tok.lit, &type, &tok.loc);
+		break;
+	case TIDENT:
+		if (tok.lit != definedname) {
+			/* identifiers that are not macros evaluate to 0 */
+			v = 0;
+			break;
+		}
+		rawnext(&t);
+		paren = t.kind == TLPAREN;
+		if (paren)
+			rawnext(&t);
+		tokencheck(&t, TIDENT, "after 'defined'");
+		v = macroget(t.lit) != NULL;
+		if (paren) {
+			rawnext(&t);
+			tokencheck(&t, TRPAREN, "after 'defined(' and identifier");
+		}
+		break;
+	case TTRUE:
+		v = 1;
+		break;
+	default:
+		/* keywords are identifiers to the preprocessor */
+		if (tok.kind < TALIGNAS || tok.kind > T__ATTRIBUTE__)
+			error(&tok.loc, "expected primary expression in #if");
+		v = 0;
+	}
+	next();
+	return v;
+}
+
+static uintmax_t
+ifbinary(bool *u, int prec, bool eval)
+{
+	struct location loc;
+	enum tokenkind op;
+	uintmax_t l, r;
+	bool ru;
+	int p;
+
+	l = ifunary(u, eval);
+	while ((p = ifprec(tok.kind)) >= prec) {
+		op = tok.kind;
+		loc = tok.loc;
+		next();
+		if (op == TLAND || op == TLOR) {
+			r = ifbinary(&ru, p + 1, eval && (op == TLAND ? l != 0 : l == 0));
+			l = op == TLAND ? l && r : l || r;
+			*u = false;
+			continue;
+		}
+		r = ifbinary(&ru, p + 1, eval);
+		if (op != TSHL && op != TSHR)
+			*u |= ru;
+		switch (op) {
+		case TMUL: l *= r; break;
+		case TDIV:
+		case TMOD:
+			if (r == 0) {
+				if (eval)
+					error(&loc, "division by zero in #if");
+				l = 0;
+			} else if (*u) {
+				l = op == TDIV ? l / r : l % r;
+			} else if ((intmax_t)r == -1) {
+				l = op == TDIV ? -l : 0;
+			} else {
+				l = op == TDIV ? (intmax_t)l / (intmax_t)r : (intmax_t)l % (intmax_t)r;
+			}
+			break;
+		case TADD: l += r; break;
+		case TSUB: l -= r; break;
+		case TSHL: l = r < sizeof(l) * CHAR_BIT ? l << r : 0; break;
+		case TSHR: l = r < sizeof(l) * CHAR_BIT ? *u ? l >> r : (uintmax_t)((intmax_t)l >> r) : 0; break;
+		case TLESS:    l = *u ? l < r : (intmax_t)l < (intmax_t)r;   *u = false; break;
+		case TGREATER: l = *u ? l > r : (intmax_t)l > (intmax_t)r;   *u = false; break;
+		case TLEQ:     l = *u ? l <= r : (intmax_t)l <= (intmax_t)r; *u = false; break;
+		case TGEQ:     l = *u ? l >= r : (intmax_t)l >= (intmax_t)r; *u = false; break;
+		case TEQL: l = l == r; *u = false; break;
+		case TNEQ: l = l != r; *u = false; break;
+		case TBAND: l &= r; break;
+		case TXOR: l ^= r; break;
+		case TBOR: l |= r; break;
+		}
+	}
+	return l;
+}
+
+/* evaluate a conditional expression; eval is false in unevaluated operands */
+static uintmax_t
+ifcond(bool *u, bool eval)
+{
+	uintmax_t v, t, f;
+	bool tu, fu;
+
+	v = ifbinary(u, 1, eval);
+	if (!consume(TQUESTION))
+		return v;
+	t = ifcond(&tu, eval && v);
+	expect(TCOLON, "in conditional expression");
+	f = ifcond(&fu, eval && !v);
+	*u = tu || fu;
+	return v ? t : f;
+}
+
+/* evaluate the controlling expression of #if or #elif */
+static bool
+ifexpr(void)
+{
+	uintmax_t v;
+	bool u;
+
+	next();
+	if (tok.kind == TNEWLINE)
+		error(&tok.loc, "expected expression after #if");
+	v = ifcond(&u, true);
+	tokencheck(&tok, TNEWLINE, "after #if expression");
+	return v != 0;
+}
+
+/* the innermost conditional has ended, or reached #elif or #else */
+static void
+condguard(bool end)
+{
+	struct include *inc;
+
+	if (includes.len == 0)
+		return;
+	inc = arraylast(&includes, sizeof(*inc));
+	if (inc->guard == GUARDIN && conds.len == inc->guardcond)
+		inc->guard = end ? GUARDEND : GUARDNONE;
+}
+
+/*
+Skip groups of the innermost conditional until one is included or the
+conditional ends. Nested conditionals in skipped groups are only
+counted, and their expressions are not evaluated.
+*/
+static void
+skipgroup(void)
+{
+	struct cond *c;
+	size_t depth;
+	char *name;
+
+	c = arraylast(&conds, sizeof(*c));
+	depth = 0;
+	for (;;) {
+		scanskip();
+		scan(&tok);
+		if (tok.kind == TEOF)
+			error(&c->loc, "unterminated conditional directive");
+		assert(tok.kind == THASH);
+		scan(&tok);
+		if (tok.kind != TIDENT)
+			continue;
+		name = tok.lit;
+		if (strcmp(name, "if") == 0 || strcmp(name, "ifdef") == 0 || strcmp(name, "ifndef") == 0) {
+			++depth;
+		} else if (strcmp(name, "endif") == 0) {
+			if (depth == 0) {
+				condguard(true);
+				conds.len -= sizeof(*c);
+				scan(&tok);
+				return;
+			}
+			--depth;
+		} else if (depth > 0) {
+			continue;
+		} else if (strcmp(name, "elif") == 0) {
+			if (c->sawelse)
+				error(&tok.loc, "#elif after #else");
+			condguard(false);
+			if (!c->taken) {
+				if (ifexpr()) {
+					c->taken = true;
+					return;
+				}
+			}
+		} else if (strcmp(name, "else") == 0) {
+			if (c->sawelse)
+				error(&tok.loc, "#else after #else");
+			c->sawelse = true;
+			condguard(false);
+			scan(&tok);
+			if (!c->taken) {
+				c->taken = true;
+				return;
+			}
+		}
+	}
+}
+
+/* 6.10.2 Source file inclusion */
+
+/* look for the file dir/name, remembering whether it exists */
+static struct header *
+header(const char *dir, size_t dirlen, const char *name)
+{
+	struct header *h;
+	struct mapkey k;
+	void **entry;
+	size_t len;
+	char *path;
+
+	len = strlen(name);
+	path = xmalloc(dirlen + len + 2);
+	if (dirlen) {
+		memcpy(path, dir, dirlen);
+		path[dirlen++] = '/';
+	}
+	memcpy(path + dirlen, name, len + 1);
+	mapkey(&k, path, dirlen + len);
+	entry = mapput(&headers, &k);
+	h = *entry;
+	if (h) {
+		free(path);
+	} else {
+		h = xmalloc(sizeof(*h));
+		h->path = path;
+		h->file = fopen(path, "r");
+		h->exists = h->file != NULL;
+		h->once = false;
+		h->tu = 0;
+		h->guard = NULL;
+		h->kind = -1;
+		h->dir = 0;
+		*entry = h;
+	}
+	return h->exists ? h : NULL;
+}
+
+/* search the include directories, starting with directory i of the given list */
+static struct header *
+searchfrom(const char *name, enum incdir kind, size_t i)
+{
+	struct header *h;
+	char *dir;
+
+	for (; kind <= INCAFTER; ++kind, i = 0) {
+		for (; i < incdirs[kind].len / sizeof(dir); ++i) {
+			dir = ((char **)incdirs[kind].val)[i];
+			h = header(dir, strlen(dir), name);
+			if (h) {
+				h->kind = kind;
+				h->dir = i;
+				return h;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* search the include directories, starting with the given list */
+static struct header *
+search(const char *name, enum incdir kind)
+{
+	struct header *h;
+	struct mapkey k;
+	void **entry;
+	char *key;
+	size_t len;
+
+	len = strlen(name);
+	key = xmalloc(len + 2);
+	key[0] = kind == INCQUOTE ? '"' : '<';
+	memcpy(key + 1, name, len + 1);
+	mapkey(&k, key, len + 1);
+	entry = mapput(&searches, &k);
+	if (*entry) {
+		free(key);
+		return *entry;
+	}
+	h = searchfrom(name, kind, 0);
+	*entry = h;
+	return h;
+}
+
+/* number of conditionals that enclose the current file */
+static size_t
+condbase(void)
+{
+	struct include *inc;
+
+	if (includes.len == 0)
+		return 0;
+	inc = arraylast(&includes, sizeof(*inc));
+	return inc->conds;
+}
+
+/*
+Read the header name of an #include or #embed directive, formed by
+macro expansion if it is not written as one, and return it with its
+delimiters. The following token is left in tok.
+*/
+static char *
+headername(const char *directive)
+{
+	struct array buf;
+	const char *lit;
+	char *name;
+
+	name = scanheadername();
+	if (name) {
+		scan(&tok);
+		return name;
+	}
+	next();
+	if (tok.kind == TSTRINGLIT && tok.lit[0] == '"') {
+		name = tok.lit;
+	} else if (tok.kind == TLESS) {
+		buf = (struct array){0};
+		arrayaddbuf(&buf, "<", 1);
+		for (next(); tok.kind != TGREATER; next()) {
+			if (tok.kind == TNEWLINE)
+				error(&tok.loc, "expected '>' after header name");
+			if (tok.space && buf.len > 1)
+				arrayaddbuf(&buf, " ", 1);
+			lit = tok.lit ? tok.lit : tokstr[tok.kind];
+			arrayaddbuf(&buf, lit, strlen(lit));
+		}
+		arrayaddbuf(&buf, ">", 2);
+		name = buf.val;
+	} else {
+		error(&tok.loc, "expected header name after #%s", directive);
+	}
+	next();
+	return name;
+}
+
+/* find the file named by a header name, continuing the search of the current file if incnext is set */
+static struct header *
+findheader(char *name, bool incnext, struct location *loc)
+{
+	struct include *inc;
+	struct header *h, *cur;
+	const char *dir, *slash;
+	bool quote;
+
+	quote = name[0] == '"';
+	name[strlen(name) - 1] = '\0';
+	++name;
+	cur = includes.len ? ((struct include *)arraylast(&includes, sizeof(*inc)))->header : NULL;
+	if (name[0] == '/') {
+		h = header(NULL, 0, name);
+	} else if (incnext && cur && cur->kind != -1) {
+		/* continue the search after the directory the current file was found in */
+		h = searchfrom(name, cur->kind, cur->dir + 1);
+	} else {
+		h = NULL;
+		if (quote) {
+			/* look in the directory of the current file first */
+			dir = scanpath();
+			slash = strrchr(dir, '/');
+			h = header(dir, slash ? slash - dir : 0, name);
+		}
+		if (!h)
+			h = search(name, quote ? INCQUOTE : INCUSER);
+	}
+	if (!h)
+		error(loc, "file '%s' not found", name);
+	return h;
+}
+
+/* handle #include, or #include_next if incnext is set */
+static void
+include(bool incnext)
+{
+	struct location loc;
+	struct include *inc;
+	struct header *h;
+	char *name;
+
+	loc = tok.loc;
+	name = headername(incnext ? "include_next" : "include");
+	tokencheck(&tok, TNEWLINE, "after header name");
+	h = findheader(name, incnext, &loc);
+	/* skip files that would have no effect, without opening them */
+	if (h->once && h->tu == tu || h->guard && macroget(h->guard))
+		return;
+	if (includes.len / sizeof(*inc) >= MAXINCLUDE)
+		error(&loc, "#include nested too deeply");
+	if (!h->file) {
+		h->file = fopen(h->path, "r");
+		if (!h->file)
+			error(&loc, "open %s: %s", h->path, strerror(errno));
+	}
+	h->tu = tu;
+	inc = arrayadd(&includes, sizeof(*inc));
+	inc->header = h;
+	inc->conds = conds.len;
+	inc->guard = GUARDSTART;
+	scaninclude(h->path, h->file);
+	h->file = NULL;
+	if (includereport)
+		reportfile(h->path, REPORTENTER);
+}
+
+/* read the balanced tokens of an #embed parameter, up to its closing parenthesis */
+static struct token *
+embedparam(size_t *n)
+{
+	struct array buf = {0};
+	struct token *t;
+	size_t paren;
+
+	paren = 0;
+	for (;;) {
+		rawnext(&tok);
+		if (tok.kind == TNEWLINE)
+			error(&tok.loc, "expected ')' after #embed parameter");
+		if (tok.kind == TLPAREN)
+			++paren;
+		else if (tok.kind == TRPAREN && paren-- == 0)
+			break;
+		t = arrayadd(&buf, sizeof(*t));
+		*t = tok;
+	}
+	*n = buf.len / sizeof(*t);
+	return buf.val;
+}
+
+/* read at most limit bytes of a resource */
+static unsigned char *
+embedread(struct header *h, uintmax_t limit, size_t *len, struct location *loc)
+{
+	FILE *file;
+	unsigned char *data;
+	size_t cap, max, n;
+
+	file = h->file ? h->file : fopen(h->path, "rb");
+	h->file = NULL;
+	if (!file)
+		error(loc, "open %s: %s", h->path, strerror(errno));
+	*len = 0;
+	cap = 1<<16;
+	data = xmalloc(cap);
+	for (;;) {
+		max = cap - *len;
+		if (limit - *len < max)
+			max = limit - *len;
+		n = fread(data + *len, 1, max, file);
+		*len += n;
+		if (n < max || *len == limit)
+			break;
+		cap *= 2;
+		data = xreallocarray(data, cap, 1);
+	}
+	if (ferror(file))
+		fatal("read %s:", h->path);
+	fclose(file);
+	return data;
+}
+
+/*
+Handle #embed. The resource is read into memory, and its bytes become
+a comma-separated list of integer constants only as the tokens are
+read, so that an initializer can take the bytes directly instead (see
+ppembed()).
+*/
+static struct embed *
+embed(void)
+{
+	struct embed *e;
+	struct header *h;
+	uintmax_t limit;
+	char *name;
+	size_t len;
+	bool u;
+
+	e = xmalloc(sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->loc = tok.loc;
+	name = headername("embed");
+	h = findheader(name, false, &e->loc);
+	limit = UINTMAX_MAX;
+	while (tok.kind != TNEWLINE) {
+		name = tokencheck(&tok, TIDENT, "for #embed parameter");
+		/* parameters may also be spelled with surrounding double underscores */
+		len = strlen(name);
+		if (len > 4 && strncmp(name, "__", 2) == 0 && strcmp(name + len - 2, "__") == 0) {
+			name += 2;
+			len -= 4;
+		}
+		rawnext(&tok);
+		tokencheck(&tok, TLPAREN, "after #embed parameter name");
+		if (len == 5 && strncmp(name, "limit", len) == 0) {
+			next();
+			limit = ifcond(&u, true);
+			if (!u && (intmax_t)limit < 0)
+				error(&tok.loc, "#embed limit is negative");
+			tokencheck(&tok, TRPAREN, "after #embed limit");
+		} else if (len == 6 && strncmp(name, "prefix", len) == 0) {
+			e->prefix = embedparam(&e->nprefix);
+		} else if (len == 6 && strncmp(name, "suffix", len) == 0) {
+			e->suffix = embedparam(&e->nsuffix);
+		} else if (len == 8 && strncmp(name, "if_empty", len) == 0) {
+			e->ifempty = embedparam(&e->nifempty);
+		} else {
+			error(&tok.loc, "unsupported #embed parameter '%.*s'", (int)len, name);
+		}
+		rawnext(&tok);
+	}
+	e->newline = tok;
+	e->data = embedread(h, limit, &e->len, &e->loc);
+	return e;
+}
+
+/* push the tokens of an #embed directive, after the directive has ended */
+static void
+embedpush(struct embed *e)
+{
+	struct frame *f;
+
+	ctxpush(&e->newline, 1, NULL, false);
+	if (e->len == 0) {
+		if (e->nifempty)
+			ctxpush(e->ifempty, e->nifempty, NULL, e->ifempty->space);
+		return;
+	}
+	if (e->nsuffix)
+		ctxpush(e->suffix, e->nsuffix, NULL, e->suffix->space);
+	f = ctxpush(NULL, 2 * e->len - 1, NULL, false);
+	f->embed = e;
+	if (e->nprefix)
+		ctxpush(e->prefix, e->nprefix, NULL, e->prefix->space);
+}
+
+/*
+If tok is the first byte of an #embed, return the bytes, with the
+number that may be taken at once with ppembedskip() in *n. That is all
+but the last, which is left to be read as a token, since it may be
+followed by the suffix.
+*/
+unsigned char *
+ppembed(size_t *n)
+{
+	struct frame *f;
+	struct embed *e;
+
+	if (tok.kind != TNUMBER || ctx.len == 0)
+		return NULL;
+	f = arraylast(&ctx, sizeof(*f));
+	e = f->embed;
+	if (!e || e->len < 2 || f->ntoken != 2 * e->len - 2 || tok.lit != bytelit[e->data[0]])
+		return NULL;
+	*n = e->len - 1;
+	return e->data;
+}
+
+/* take the first n bytes of the #embed begun by tok, leaving tok at the comma after them */
+void
+ppembedskip(size_t n)
+{
+	struct frame *f;
+
+	f = arraylast(&ctx, sizeof(*f));
+	f->ntoken = 2 * (f->embed->len - n);
+	embednext(f, &tok);
+}
+
+/* finish reading an included file */
+static void
+endinclude(void)
+{
+	struct include *inc;
+	struct cond *c;
+
+	inc = arraylast(&includes, sizeof(*inc));
+	if (conds.len > inc->conds) {
+		c = arraylast(&conds, sizeof(*c));
+		error(&c->loc, "unterminated conditional directive");
+	}
+	if (inc->guard == GUARDEND)
+		inc->header->guard = inc->guardname;
+	includes.len -= sizeof(*inc);
+	scanclose();
+	newline = true;
+	if (includereport)
+		reportfile(NULL, REPORTLEAVE);
+}
+
 static void
 directive(void)
 {
 	struct location newloc;
 	enum ppflags oldflags;
+	struct include *inc;
+	struct cond *c;
+	struct frame *f;
+	struct embed *e = NULL;
 	char *name = NULL;
+	size_t base;
+	bool first;
+	int flag;
 
 	scan(&tok);
 	if (tok.kind == TNEWLINE)
 		return;  /* empty directive */
 	oldflags = ppflags;
 	ppflags |= PPNEWLINE;
+	indirective = true;
+	base = ctx.len;
+	inc = includes.len ? arraylast(&includes, sizeof(*inc)) : NULL;
 	if (tok.kind == TNUMBER)
 		goto line;  /* gcc line markers */
 	name = tokencheck(&tok, TIDENT, "newline, or number after '#'");
-	if (strcmp(name, "if") == 0) {
-		error(&tok.loc, "#if directive is not implemented");
-	} else if (strcmp(name, "ifdef") == 0) {
-		error(&tok.loc, "#ifdef directive is not implemented");
-	} else if (strcmp(name, "ifndef") == 0) {
-		error(&tok.loc, "#ifndef directive is not implemented");
-	} else if (strcmp(name, "elif") == 0) {
-		error(&tok.loc, "#elif directive is not implemented");
+	/* an include guard is an #ifndef before anything else, matched by an #endif at the end */
+	first = inc && inc->guard == GUARDSTART;
+	if (inc && inc->guard != GUARDIN)
+		inc->guard = GUARDNONE;
+	if (strcmp(name, "if") == 0 || strcmp(name, "ifdef") == 0 || strcmp(name, "ifndef") == 0) {
+		c = arrayadd(&conds, sizeof(*c));
+		c->loc = tok.loc;
+		c->sawelse = false;
+		if (name[2] == '\0') {
+			c->taken = ifexpr();
+		} else {
+			scan(&tok);
+			c->taken = !macroget(tokencheck(&tok, TIDENT, "after #ifdef or #ifndef")) == (name[2] == 'n');
+			if (first && name[2] == 'n') {
+				inc->guard = GUARDIN;
+				inc->guardname = tok.lit;
+				inc->guardcond = conds.len;
+			}
+			scan(&tok);
+		}
+		if (!c->taken)
+			skipgroup();
+	} else if (strcmp(name, "elif") == 0 || strcmp(name, "else") == 0) {
+		if (conds.len <= condbase())
+			error(&tok.loc, "#%s without #if", name);
+		c = arraylast(&conds, sizeof(*c));
+		if (c->sawelse)
+			error(&tok.loc, "#%s after #else", name);
+		condguard(false);
+		/* a previous group was included, so skip the rest */
+		if (name[2] == 's') {
+			c->sawelse = true;
+			scan(&tok);
+			tokencheck(&tok, TNEWLINE, "after #else");
+		}
+		skipgroup();
 	} else if (strcmp(name, "endif") == 0) {
-		error(&tok.loc, "#endif directive is not implemented");
-	} else if (strcmp(name, "include") == 0) {
-		error(&tok.loc, "#include directive is not implemented");
+		if (conds.len <= condbase())
+			error(&tok.loc, "#endif without #if");
+		condguard(true);
+		conds.len -= sizeof(*c);
+		scan(&tok);
+	} else if (strcmp(name, "include") == 0 || strcmp(name, "include_next") == 0) {
+		include(name[7] == '_');
+	} else if (strcmp(name, "embed") == 0) {
+		e = embed();
 	} else if (strcmp(name, "define") == 0) {
 		scan(&tok);
 		define();
@@ -339,11 +1800,17 @@ line:
 		newloc.col = 1;
 		scan(&tok);
 		newloc.file = tok.loc.file;
+		flag = 0;
 		if (tok.kind == TSTRINGLIT) {
 			/* XXX: handle escape sequences (reuse string decoding from expr.c) */
 			newloc.file = strchr(tok.lit, '"') + 1;
 			*strchr(newloc.file, '"') = '\0';
 			scan(&tok);
+			/* the first flag of a line marker tells whether a file is entered or returned to */
+			if (tok.kind == TNUMBER)
+				flag = strtol(tok.lit, NULL, 10);
+			if (includereport)
+				reportfile(newloc.file, flag == 1 ? REPORTENTER : flag == 2 ? REPORTLEAVE : REPORTSWITCH);
 		}
 		while (tok.kind == TNUMBER)
 			scan(&tok);
@@ -351,69 +1818,153 @@ line:
 	} else if (strcmp(name, "error") == 0) {
 		error(&tok.loc, "#error directive is not implemented");
 	} else if (strcmp(name, "pragma") == 0) {
+		scan(&tok);
+		if (tok.kind == TIDENT && strcmp(tok.lit, "once") == 0 && inc) {
+			inc->header->once = true;
+			scan(&tok);
+		}
 		while (tok.kind != TNEWLINE && tok.kind != TEOF)
 			next();
 	} else {
 		error(&tok.loc, "invalid preprocessor directive #%s", name);
 	}
-	free(name);
 	tokencheck(&tok, TNEWLINE, "after preprocessing directive");
 	ppflags = oldflags;
+	indirective = false;
+	/* end the expansions of macros used in the directive */
+	while (ctx.len > base) {
+		f = arraylast(&ctx, sizeof(*f));
+		assert(f->ntoken == 0);
+		if (f->macro)
+			macrodone(f->macro);
+		ctx.len -= sizeof(*f);
+	}
+	if (e)
+		embedpush(e);
 }
 
 /* get the next token without expanding it */
 static void
 nextinto(struct token *t)
 {
-	static bool newline = true;
+	struct include *inc;
+	struct cond *c;
 
 	for (;;) {
 		scan(t);
+		srcloc = t->loc;
+		if (t->kind == TEOF && includes.len) {
+			endinclude();
+			continue;
+		}
+		if (t->kind == TEOF && conds.len) {
+			c = arraylast(&conds, sizeof(*c));
+			error(&c->loc, "unterminated conditional directive");
+		}
 		if (newline && t->kind == THASH) {
 			directive();
+			/* #embed leaves its tokens in the context, and the next line still starts a line */
+			if (ctxnext(t))
+				break;
 		} else {
+			if (t->kind != TNEWLINE && includes.len) {
+				inc = arraylast(&includes, sizeof(*inc));
+				if (inc->guard != GUARDIN)
+					inc->guard = GUARDNONE;
+			}
 			newline = tok.kind == TNEWLINE;
 			break;
 		}
 	}
 }
 
-static struct token *
-rawnext(void)
+/* get the next token into t, without expanding it */
+static void
+rawnext(struct token *t)
+{
+	if (!ctxnext(t)) {
+		nextinto(&tok);
+		*t = tok;
+	}
+}
+
+/* whether n tokens close the parenthesis left open after *paren others */
+static bool
+closesparen(struct token *t, size_t n, size_t *paren)
+{
+	for (; n > 0; ++t, --n) {
+		if (t->kind == TLPAREN)
+			++*paren;
+		else if (t->kind == TRPAREN && (*paren)-- == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+Whether the arguments of an invocation within a macro argument, whose
+'(' has just been read, are closed before the end of the argument.
+*/
+static bool
+argsclosed(void)
 {
+	struct frame *f;
 	struct token *t;
+	struct macroarg *arg;
+	size_t paren, i;
 
-	t = ctxnext();
-	if (!t) {
-		t = &tok;
-		nextinto(t);
+	paren = 0;
+	for (f = arraylast(&ctx, sizeof(*f)); (char *)f >= (char *)ctx.val + argend; --f) {
+		/* the bytes of #embed are separated by commas, not parentheses */
+		if (f->embed)
+			continue;
+		if (!framelazy(f)) {
+			if (closesparen(f->token, f->ntoken, &paren))
+				return true;
+			continue;
+		}
+		for (t = f->token; t < f->token + f->ntoken; ++t) {
+			i = f->macro->ref[t - f->macro->token];
+			if (i == -1) {
+				if (closesparen(t, 1, &paren))
+					return true;
+			} else if (t->kind == THASH) {
+				/* a stringized parameter is a single string literal */
+				++t;
+			} else {
+				arg = &f->macro->inv->arg[i];
+				if (closesparen(arg->token, arg->ntoken, &paren))
+					return true;
+			}
+		}
 	}
-	return t;
+	return false;
 }
 
 static bool
 peekparen(void)
 {
 	static struct array pending;
-	struct token *t;
+	struct token t, *p;
 	struct frame *f;
 
-	t = ctxnext();
-	if (t) {
-		if (t->kind == TLPAREN)
+	if (ctxnext(&t)) {
+		/* 6.10.3.1p1: an invocation must be complete within an argument */
+		if (t.kind == TLPAREN && (!argend || argsclosed()))
 			return true;
 		f = arraylast(&ctx, sizeof(*f));
-		--f->token;
+		if (!f->embed)
+			--f->token;
 		++f->ntoken;
 		return false;
 	}
 	pending.len = 0;
-	do t = arrayadd(&pending, sizeof(*t)), nextinto(t);
-	while (t->kind == TNEWLINE);
-	if (t->kind == TLPAREN)
+	do p = arrayadd(&pending, sizeof(*p)), nextinto(p);
+	while (p->kind == TNEWLINE && !indirective);
+	if (p->kind == TLPAREN)
 		return true;
-	t = pending.val;
-	ctxpush(t, pending.len / sizeof(*t), NULL, t[0].space);
+	p = pending.val;
+	ctxpush(p, pending.len / sizeof(*p), NULL, p->space);
 	return false;
 }
 
@@ -436,205 +1987,470 @@ stringize(struct array *buf, struct token *t)
 	}
 }
 
-static void expandfunc(struct macro *);
+
+static bool expand(struct token *);
+
+/*
+Fully macro-replace the tokens of an argument, as if they formed the
+rest of the input. If any tokens were replaced, append the result to
+buf and return true; otherwise, the argument stands for itself.
+*/
+static bool
+expandarg(struct array *buf, struct token *raw, size_t nraw)
+{
+	struct token t, end;
+	size_t base, oldend, n;
+	bool hide, copy;
+
+	if (nraw == 0)
+		return false;
+	base = ctx.len;
+	end.kind = TEOF;
+	end.loc = raw[nraw - 1].loc;
+	ctxpush(&end, 1, NULL, false);
+	oldend = argend;
+	argend = ctx.len;
+	ctxpush(raw, nraw, NULL, raw->space);
+	/* the first n tokens of the argument have been passed through unchanged */
+	n = 0;
+	copy = false;
+	for (;;) {
+		rawnext(&t);
+		if (t.kind == TEOF)
+			break;
+		hide = t.hide;
+		if (expand(&t)) {
+			if (!copy)
+				arrayaddbuf(buf, raw, n * sizeof(*raw));
+			copy = true;
+		} else if (copy || t.hide != hide) {
+			if (!copy)
+				arrayaddbuf(buf, raw, n * sizeof(*raw));
+			arrayaddbuf(buf, &t, sizeof(t));
+			copy = true;
+		} else {
+			++n;
+		}
+	}
+	/* the frames above have ended, leaving just the exhausted sentinel */
+	ctx.len = base;
+	argend = oldend;
+	return copy;
+}
+
+/* 6.10.3.3 The ## operator */
+static void
+pastetoken(struct token *l, const struct token *r)
+{
+	struct array buf = {0};
+	struct token t, extra;
+	const char *llit, *rlit;
+
+	if (r->kind == TNONE)
+		return;
+	if (l->kind == TNONE) {
+		t = *r;
+		t.space = l->space;
+		*l = t;
+		return;
+	}
+	llit = l->lit ? l->lit : tokstr[l->kind];
+	rlit = r->lit ? r->lit : tokstr[r->kind];
+	arrayaddbuf(&buf, llit, strlen(llit));
+	arrayaddbuf(&buf, rlit, strlen(rlit));
+	scanbuf(l->loc.file, buf.val, buf.len);
+	scan(&t);
+	scan(&extra);
+	if (t.kind == TEOF || extra.kind != TEOF)
+		error(&l->loc, "pasting \"%s\" and \"%s\" does not give a valid preprocessing token", llit, rlit);
+	scanclose();
+	free(buf.val);
+	t.loc = l->loc;
+	t.space = l->space;
+	*l = t;
+}
+
+/*
+Build the replacement list of a macro invocation whose definition
+contains the '##' operator, with its arguments substituted and its
+tokens pasted, and return the number of tokens in it.
+*/
+static size_t
+substitute(struct macro *m)
+{
+	struct array *buf;
+	struct token *t, *end, *src, *dst, placemarker;
+	struct macroarg *arg;
+	size_t i, n;
+	bool paste, space;
+
+	buf = &m->inv->subst;
+	paste = false;
+	end = m->token + m->ntoken;
+	for (t = m->token; t < end; ++t) {
+		if (t->kind == THASHHASH) {
+			paste = true;
+			continue;
+		}
+		space = t->space;
+		src = t;
+		n = 1;
+		i = m->ref ? m->ref[t - m->token] : -1;
+		if (i != -1 && t->kind == THASH) {
+			++t;
+			src = &m->inv->arg[i].str;
+		} else if (i != -1) {
+			arg = &m->inv->arg[i];
+			if (paste || t + 1 < end && t[1].kind == THASHHASH)
+				src = arg->raw, n = arg->nraw;
+			else
+				src = arg->token, n = arg->ntoken;
+			/*
+			As an extension, ', ## __VA_ARGS__' is not a paste; the
+			comma is removed if there are no variable arguments.
+			*/
+			if (paste && m->param[i].flags & PARAMVAR && buf->len > 0) {
+				dst = arraylast(buf, sizeof(*dst));
+				if (dst->kind == TCOMMA) {
+					paste = false;
+					if (n == 0) {
+						buf->len -= sizeof(*dst);
+						continue;
+					}
+				}
+			}
+			if (n == 0) {
+				placemarker.kind = TNONE;
+				placemarker.loc = t->loc;
+				src = &placemarker;
+				n = 1;
+			}
+		}
+		if (paste) {
+			pastetoken(arraylast(buf, sizeof(*dst)), src);
+			++src, --n;
+			paste = false;
+		} else {
+			arrayaddbuf(buf, src, sizeof(*src));
+			dst = arraylast(buf, sizeof(*dst));
+			dst->space = space;
+			++src, --n;
+		}
+		arrayaddbuf(buf, src, n * sizeof(*src));
+	}
+	/* remove the remaining placemarkers */
+	n = 0;
+	for (src = dst = buf->val; src < (struct token *)buf->val + buf->len / sizeof(*src); ++src) {
+		if (src->kind != TNONE)
+			dst[n++] = *src;
+	}
+	return n;
+}
+
+/* expand __FILE__ or __LINE__ */
+static bool
+expandbuiltin(struct token *t)
+{
+	static struct token result;
+	struct array buf = {0};
+	char line[(sizeof(size_t) * CHAR_BIT + 2) / 3 + 1];
+	const char *p;
+
+	result.loc = t->loc;
+	result.hide = false;
+	if (t->lit == linename) {
+		result.kind = TNUMBER;
+		arrayaddbuf(&buf, line, snprintf(line, sizeof(line), "%zu", srcloc.line) + 1);
+	} else {
+		result.kind = TSTRINGLIT;
+		arrayaddbuf(&buf, "\"", 1);
+		for (p = srcloc.file; *p; ++p) {
+			if (*p == '\\' || *p == '"')
+				arrayaddbuf(&buf, "\\", 1);
+			arrayaddbuf(&buf, p, 1);
+		}
+		arrayaddbuf(&buf, "\"", 2);
+	}
+	result.lit = buf.val;
+	ctxpush(&result, 1, NULL, t->space);
+	return true;
+}
+
+
+/* count the tokens of a replacement list with the arguments substituted */
+static size_t
+replacementlen(struct macro *m)
+{
+	size_t i, n;
+
+	if (!m->ref)
+		return m->ntoken;
+	n = 0;
+	for (i = 0; i < m->ntoken; ++i) {
+		if (m->ref[i] == -1) {
+			++n;
+		} else if (m->token[i].kind == THASH) {
+			/* the operand is replaced along with the operator */
+			++n, ++i;
+		} else {
+			n += m->inv->arg[m->ref[i]].ntoken;
+		}
+	}
+	return n;
+}
+
+/* record an expansion of m, producing n tokens */
+static void
+macrostat(struct macro *m, size_t n, clock_t time)
+{
+	struct macrostat *st;
+	struct mapkey k;
+	void **entry;
+
+	if (!stats.len)
+		mapinit(&stats, 64);
+	internkey(&k, m->name);
+	entry = mapput(&stats, &k);
+	st = *entry;
+	if (!st) {
+		st = xmalloc(sizeof(*st));
+		*st = (struct macrostat){.name = m->name};
+		*entry = st;
+	}
+	++st->count;
+	st->tokens += n;
+	if (st->depth < macrodepth)
+		st->depth = macrodepth;
+	st->time += time;
+}
+
+static struct invocation *expandfunc(struct macro *);
 
 static bool
 expand(struct token *t)
 {
 	struct macro *m;
+	struct invocation *inv;
+	size_t n;
 	bool space;
+	clock_t start, time;
 
-	if (t->kind != TIDENT)
+	if (t->kind != TIDENT || t->hide)
 		return false;
 	m = macroget(t->lit);
-	if (!m || m->hide)
+	if (!m) {
+		if (t->lit == filename || t->lit == linename)
+			return expandbuiltin(t);
+		return false;
+	}
+	if (m->hide) {
 		t->hide = true;
-	if (t->hide)
 		return false;
+	}
+	/* t may be overwritten while reading the arguments */
 	space = t->space;
+	inv = NULL;
+	start = 0;
+	time = 0;
 	if (m->kind == MACROFUNC) {
 		if (!peekparen())
 			return false;
-		expandfunc(m);
+		if (ppflags & PPSTATS) {
+			++statsdepth;
+			start = clock();
+		}
+		inv = expandfunc(m);
+		if (ppflags & PPSTATS) {
+			time = clock() - start;
+			if (--statsdepth == 0)
+				statstime += time;
+		}
+	} else if (m->paste) {
+		inv = invocation(0);
+	}
+	m->inv = inv;
+	if (m->paste) {
+		n = substitute(m);
+		ctxpush(inv->subst.val, n, m, space);
+	} else {
+		n = 0;
+		ctxpush(m->token, m->ntoken, m, space);
 	}
-	ctxpush(m->token, m->ntoken, m, space);
 	m->hide = true;
 	++macrodepth;
+	if (ppflags & PPSTATS)
+		macrostat(m, m->paste ? n : replacementlen(m), time);
 	return true;
 }
 
-static void
+/*
+Read the arguments of a function-like macro invocation, up to the
+closing parenthesis, and return them as one sequence of n tokens. If
+they lie entirely within the current frame, they are used in place,
+since the frame outlives the invocation. Otherwise, they are copied
+to buf.
+*/
+static struct token *
+readargs(struct macro *m, struct array *buf, size_t *n, struct location *end)
+{
+	struct token t, *p, *list;
+	struct macro *mm;
+	struct frame *f;
+	size_t paren;
+	bool space;
+
+	paren = 0;
+	f = ctx.len ? arraylast(&ctx, sizeof(*f)) : NULL;
+	/* the first token of a frame may have its spacing overridden */
+	if (f && f->token != f->start) {
+		for (p = f->token; p < f->token + f->ntoken; ++p) {
+			if (framelazy(f) && f->macro->ref[p - f->macro->token] != -1)
+				break;
+			if (p->kind == TLPAREN) {
+				++paren;
+			} else if (p->kind == TRPAREN && paren-- == 0) {
+				list = f->token;
+				*n = p - list;
+				*end = p->loc;
+				f->ntoken -= *n + 1;
+				f->token = p + 1;
+				return list;
+			}
+		}
+		paren = 0;
+	}
+	space = false;
+	for (;;) {
+		rawnext(&t);
+		switch (t.kind) {
+		case TEOF:
+			error(&t.loc, "EOF when reading macro parameters");
+			break;
+		case TNEWLINE:
+			if (indirective)
+				error(&t.loc, "unterminated invocation of macro '%s'", m->name);
+			/* a newline in the arguments is just white space */
+			space = true;
+			continue;
+		case TLPAREN:
+			++paren;
+			break;
+		case TRPAREN:
+			if (paren-- == 0)
+				goto done;
+			break;
+		case TIDENT:
+			/* 6.10.3.4p2: the expansion being read from may end before the argument is replaced */
+			if (macrodepth && !t.hide && (mm = macroget(t.lit)) && mm->hide)
+				t.hide = true;
+			break;
+		}
+		if (space) {
+			t.space = true;
+			space = false;
+		}
+		arrayaddbuf(buf, &t, sizeof(t));
+	}
+done:
+	*n = buf->len / sizeof(t);
+	*end = t.loc;
+	return buf->val;
+}
+
+static struct invocation *
 expandfunc(struct macro *m)
 {
+	struct invocation *inv;
 	struct macroparam *p;
 	struct macroarg *arg;
-	struct array str, tok;
-	size_t i, depth, paren;
-	struct token *t;
+	struct location loc;
+	struct array str;
+	struct token *t, *end;
+	size_t i, n, paren;
 
-	/* read macro arguments */
+	/* read macro arguments, without expanding them yet */
+	inv = invocation(m->nparam);
+	arg = inv->arg;
+	t = readargs(m, &inv->raw, &n, &loc);
+	end = t + n;
+	if (m->nparam == 0 && n > 0)
+		error(&t->loc, "too many arguments for macro '%s'", m->name);
+	i = 0;
 	paren = 0;
-	depth = macrodepth;
-	tok = (struct array){0};
-	arg = xreallocarray(NULL, m->nparam, sizeof(*arg));
-	t = rawnext();
+	if (m->nparam > 0)
+		arg[0].raw = t;
+	for (; t < end; ++t) {
+		switch (t->kind) {
+		case TLPAREN: ++paren; continue;
+		case TRPAREN: --paren; continue;
+		case TCOMMA: break;
+		default: continue;
+		}
+		if (paren > 0 || m->param[i].flags & PARAMVAR)
+			continue;
+		arg[i].nraw = t - arg[i].raw;
+		if (++i == m->nparam)
+			error(&t->loc, "too many arguments for macro '%s'", m->name);
+		arg[i].raw = t + 1;
+	}
+	if (m->nparam > 0)
+		arg[i].nraw = end - arg[i].raw;
+	if (i + 2 == m->nparam && macrovarargs(m)) {
+		/* the variable arguments may be omitted entirely, as in C23 */
+		arg[++i].raw = end;
+		arg[i].nraw = 0;
+	}
+	if (i + 1 < m->nparam)
+		error(&loc, "not enough arguments for macro '%s'", m->name);
+
+	/* stringize and macro-replace the arguments, as they are used */
 	for (i = 0; i < m->nparam; ++i) {
 		p = &m->param[i];
 		if (p->flags & PARAMSTR) {
 			str = (struct array){0};
 			arrayaddbuf(&str, "\"", 1);
-		}
-		arg[i].ntoken = 0;
-		for (;;) {
-			if (t->kind == TEOF)
-				error(&t->loc, "EOF when reading macro parameters");
-			if (macrodepth <= depth) {
-				/* adjust current macro depth, in case it got shallower */
-				depth = macrodepth;
-				if (paren == 0 && (t->kind == TRPAREN || t->kind == TCOMMA && !(p->flags & PARAMVAR)))
-					break;
-				switch (t->kind) {
-				case TLPAREN: ++paren; break;
-				case TRPAREN: --paren; break;
-				}
-				if (p->flags & PARAMSTR)
-					stringize(&str, t);
-			}
-			if (p->flags & PARAMTOK && !expand(t)) {
-				arrayaddbuf(&tok, t, sizeof(*t));
-				++arg[i].ntoken;
-			}
-			t = rawnext();
-		}
-		if (p->flags & PARAMSTR) {
+			for (t = arg[i].raw; t < arg[i].raw + arg[i].nraw; ++t)
+				stringize(&str, t);
 			arrayaddbuf(&str, "\"", 2);
 			arg[i].str = (struct token){
 				.kind = TSTRINGLIT,
 				.lit = str.val,
 			};
 		}
-		if (t->kind == TRPAREN)
-			break;
-		t = rawnext();
-	}
-	if (i + 1 < m->nparam)
-		error(&t->loc, "not enough arguments for macro '%s'", m->name);
-	if (t->kind != TRPAREN)
-		error(&t->loc, "too many arguments for macro '%s'", m->name);
-	for (i = 0, t = tok.val; i < m->nparam; ++i) {
-		arg[i].token = t;
-		t += arg[i].ntoken;
+		arg[i].token = arg[i].raw;
+		arg[i].ntoken = arg[i].nraw;
+		if (p->flags & PARAMTOK) {
+			n = inv->token.len;
+			if (expandarg(&inv->token, arg[i].raw, arg[i].nraw)) {
+				arg[i].token = NULL;
+				arg[i].ntoken = (inv->token.len - n) / sizeof(*t);
+			}
+		}
 	}
-	m->arg = arg;
-}
-
-static void
-keyword(struct token *tok)
-{
-	static const struct {
-		const char *name;
-		int value;
-	} keywords[] = {
-		{"_Alignas",       TALIGNAS},
-		{"_Alignof",       TALIGNOF},
-		{"_Atomic",        T_ATOMIC},
-		{"_Bool",          TBOOL},
-		{"_Complex",       T_COMPLEX},
-		{"_Decimal128",    T_DECIMAL128},
-		{"_Decimal32",     T_DECIMAL32},
-		{"_Decimal64",     T_DECIMAL64},
-		{"_Generic",       T_GENERIC},
-		{"_Imaginary",     T_IMAGINARY},
-		{"_Noreturn",      T_NORETURN},
-		{"_Static_assert", TSTATIC_ASSERT},
-		{"_Thread_local",  TTHREAD_LOCAL},
-		{"__alignof__",    TALIGNOF},
-		{"__asm",          T__ASM__},
-		{"__asm__",        T__ASM__},
-		{"__attribute__",  T__ATTRIBUTE__},
-		{"__inline",       TINLINE},
-		{"__inline__",     TINLINE},
-		{"__signed",       TSIGNED},
-		{"__signed__",     TSIGNED},
-		{"__thread",       TTHREAD_LOCAL},
-		{"__typeof",       TTYPEOF},
-		{"__typeof__",     TTYPEOF},
-		{"__volatile__",   TVOLATILE},
-		{"alignas",        TALIGNAS},
-		{"alignof",        TALIGNOF},
-		{"auto",           TAUTO},
-		{"bool",           TBOOL},
-		{"break",          TBREAK},
-		{"case",           TCASE},
-		{"char",           TCHAR},
-		{"const",          TCONST},
-		{"constexpr",      TCONSTEXPR},
-		{"continue",       TCONTINUE},
-		{"default",        TDEFAULT},
-		{"do",             TDO},
-		{"double",         TDOUBLE},
-		{"else",           TELSE},
-		{"enum",           TENUM},
-		{"extern",         TEXTERN},
-		{"false",          TFALSE},
-		{"float",          TFLOAT},
-		{"for",            TFOR},
-		{"goto",           TGOTO},
-		{"if",             TIF},
-		{"inline",         TINLINE},
-		{"int",            TINT},
-		{"long",           TLONG},
-		{"nullptr",        TNULLPTR},
-		{"register",       TREGISTER},
-		{"restrict",       TRESTRICT},
-		{"return",         TRETURN},
-		{"short",          TSHORT},
-		{"signed",         TSIGNED},
-		{"sizeof",         TSIZEOF},
-		{"static",         TSTATIC},
-		{"static_assert",  TSTATIC_ASSERT},
-		{"struct",         TSTRUCT},
-		{"switch",         TSWITCH},
-		{"thread_local",   TTHREAD_LOCAL},
-		{"true",           TTRUE},
-		{"typedef",        TTYPEDEF},
-		{"typeof",         TTYPEOF},
-		{"typeof_unqual",  TTYPEOF_UNQUAL},
-		{"union",          TUNION},
-		{"unsigned",       TUNSIGNED},
-		{"void",           TVOID},
-		{"volatile",       TVOLATILE},
-		{"while",          TWHILE},
-	};
-	size_t low = 0, high = LEN(keywords), mid;
-	int cmp;
-
-	while (low < high) {
-		mid = (low + high) / 2;
-		cmp = strcmp(tok->lit, keywords[mid].name);
-		if (cmp == 0) {
-			free(tok->lit);
-			tok->kind = keywords[mid].value;
-			tok->lit = NULL;
-			break;
+	/* the replaced arguments are in place now that their storage is complete */
+	for (i = 0, t = inv->token.val; i < m->nparam; ++i) {
+		if (!arg[i].token) {
+			arg[i].token = t;
+			t += arg[i].ntoken;
 		}
-		if (cmp < 0)
-			high = mid;
-		else
-			low = mid + 1;
 	}
+	return inv;
 }
 
 void
 next(void)
 {
-	struct token *t;
+	int kind;
 
-	do t = rawnext();
-	while (expand(t) || t->kind == TNEWLINE && !(ppflags & PPNEWLINE));
-	tok = *t;
-	if (tok.kind == TIDENT)
-		keyword(&tok);
+	do rawnext(&tok);
+	while (expand(&tok) || tok.kind == TNEWLINE && !(ppflags & PPNEWLINE));
+	if (tok.kind == TIDENT) {
+		kind = *internval(tok.lit);
+		if (kind) {
+			tok.kind = kind;
+			tok.lit = NULL;
+		}
+	}
 }
 
 bool
@@ -674,3 +2490,70 @@ consume(int kind)
 	next();
 	return true;
 }
+
+static int
+statcmp(const void *p1, const void *p2)
+{
+	const struct macrostat *s1 = *(struct macrostat **)p1, *s2 = *(struct macrostat **)p2;
+
+	if (s1->tokens != s2->tokens)
+		return s1->tokens < s2->tokens ? 1 : -1;
+	return strcmp(s1->name, s2->name);
+}
+
+/*
+Print the statistics of the top macros by the number of tokens they
+produced, and the totals for the translation unit, to stderr. If top
+is 0, all macros are printed. The statistics are then cleared.
+*/
+void
+ppstats(size_t top, bool json)
+{
+	struct array sorted = {0};
+	struct macrostat **st, total = {0};
+	const char *name;
+	size_t i, n;
+
+	for (i = 0; i < stats.cap && stats.len; ++i) {
+		if (!stats.keys[i].str)
+			continue;
+		st = arrayadd(&sorted, sizeof(*st));
+		*st = stats.vals[i];
+		total.count += (*st)->count;
+		total.tokens += (*st)->tokens;
+		if (total.depth < (*st)->depth)
+			total.depth = (*st)->depth;
+	}
+	n = sorted.len / sizeof(*st);
+	qsort(sorted.val, n, sizeof(*st), statcmp);
+	if (top == 0 || top > n)
+		top = n;
+	name = scanpath();
+	if (json) {
+		fputs("{\n\t\"input\": ", stderr);
+		jsonstr(name);
+		fputs(",\n\t\"macros\": [", stderr);
+		for (i = 0, st = sorted.val; i < top; ++i, ++st) {
+			fprintf(stderr, "%s\n\t\t{\"name\": ", i ? "," : "");
+			jsonstr((*st)->name);
+			fprintf(stderr, ", \"invocations\": %llu, \"tokens\": %llu, \"depth\": %zu, \"time\": %.6f}",
+				(*st)->count, (*st)->tokens, (*st)->depth, (double)(*st)->time / CLOCKS_PER_SEC);
+		}
+		fprintf(stderr, "\n\t],\n\t\"total\": {\"macros\": %zu, \"invocations\": %llu, \"tokens\": %llu, \"depth\": %zu, \"time\": %.6f}\n}\n",
+			n, total.count, total.tokens, total.depth, (double)statstime / CLOCKS_PER_SEC);
+	} else {
+		for (i = 0, st = sorted.val; i < top; ++i, ++st) {
+			fprintf(stderr, "%s: %s: %-24s %10llu invocations %12llu tokens %4zu depth %8.3fs\n",
+				argv0, name, (*st)->name, (*st)->count, (*st)->tokens, (*st)->depth, (double)(*st)->time / CLOCKS_PER_SEC);
+		}
+		fprintf(stderr, "%s: %s: %-24s %10llu invocations %12llu tokens %4zu depth %8.3fs in %zu macros\n",
+			argv0, name, "total", total.count, total.tokens, total.depth, (double)statstime / CLOCKS_PER_SEC, n);
+	}
+	for (st = sorted.val; st < (struct macrostat **)sorted.val + n; ++st)
+		free(*st);
+	free(sorted.val);
+	if (stats.len)
+		mapfree(&stats, NULL);
+	stats.len = 0;
+	statstime = 0;
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -95,10 +97,66 @@ struct func {
 	struct block *start, *end;
 	struct map gotos;
 	unsigned lastid;
+	/* location of the function body */
+	struct location loc;
+	/* emission was deferred until the whole program is seen */
+	bool deferred;
+};
+
+/* a function or object definition whose emission is deferred */
+struct defn {
+	struct value *value;
+	struct func *func;
+	struct decl *decl;
+	struct init *init;
+	struct location loc;
+	bool global, reachable;
+	struct defn *next;
 };
 
 static const int ptrclass = 'l';
 
+bool syntaxonly;
+bool wholeprogram;
+
+static struct defn *defns, **defnsend = &defns;
+/* names of the definitions which are always emitted */
+static struct array roots;
+/* IDs of objects and functions with internal linkage in the current translation unit */
+static struct map internids;
+/* counters for unique block, global, and type names */
+static unsigned blockid, globalid, typeid;
+
+/* write QBE IL to stdout, counting it for the include report */
+static void
+out(const char *s)
+{
+	fputs(s, stdout);
+	if (includereport)
+		reportadd(REPORTBYTES, strlen(s));
+}
+
+static void
+outc(int c)
+{
+	putchar(c);
+	if (includereport)
+		reportadd(REPORTBYTES, 1);
+}
+
+static void
+outf(const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vprintf(fmt, ap);
+	va_end(ap);
+	if (includereport && n > 0)
+		reportadd(REPORTBYTES, n);
+}
+
 void
 switchcase(struct switchcases *cases, unsigned long long i, struct block *b)
 {
@@ -115,13 +173,20 @@ switchcase(struct switchcases *cases, unsigned long long i, struct block *b)
 struct block *
 mkblock(char *name)
 {
-	static unsigned id;
+	/*
+	Nothing is emitted to blocks, so every label shares one. Labels
+	are only compared with null, and goto labels are found by name.
+	*/
+	static struct block nullblock;
 	struct block *b;
 
+	if (syntaxonly)
+		return &nullblock;
+
 	b = xmalloc(sizeof(*b));
 	b->label.kind = VALUE_LABEL;
 	b->label.u.name = name;
-	b->label.id = ++id;
+	b->label.id = ++blockid;
 	b->insts = (struct array){0};
 	b->jump.kind = JUMP_NONE;
 	b->phi.res.kind = VALUE_NONE;
@@ -130,10 +195,30 @@ mkblock(char *name)
 	return b;
 }
 
+/* every declaration of an identifier with internal linkage gets the same ID */
+static unsigned
+internid(const char *name)
+{
+	struct mapkey k;
+	void **entry;
+	unsigned *id;
+
+	if (!internids.len)
+		mapinit(&internids, 64);
+	mapkey(&k, name, strlen(name));
+	entry = mapput(&internids, &k);
+	id = *entry;
+	if (!id) {
+		id = xmalloc(sizeof(*id));
+		*id = ++globalid;
+		*entry = id;
+	}
+	return *id;
+}
+
 struct value *
 mkglobal(struct decl *d)
 {
-	static unsigned id;
 	struct value *v;
 
 	v = xmalloc(sizeof(*v));
@@ -143,9 +228,13 @@ mkglobal(struct decl *d)
 	if (d->asmname) {
 		v->u.name = d->asmname;
 		v->id = 0;
+	} else if (wholeprogram && d->linkage == LINKINTERN) {
+		/* rename so that it does not collide with other translation units */
+		v->u.name = d->name;
+		v->id = internid(d->name);
 	} else {
 		v->u.name = d->name;
-		v->id = d->linkage == LINKNONE ? ++id : 0;
+		v->id = d->linkage == LINKNONE ? ++globalid : 0;
 	}
 
 	return v;
@@ -510,9 +599,15 @@ mkfunc(struct decl *decl, char *name, struct type *t, struct scope *s)
 	f->decl = decl;
 	f->name = name;
 	f->type = t;
-	f->start = f->end = mkblock("start");
 	f->lastid = 0;
+	f->loc = tok.loc;
+	f->deferred = false;
 	mapinit(&f->gotos, 8);
+	if (syntaxonly) {
+		f->start = f->end = NULL;
+		goto name;
+	}
+	f->start = f->end = mkblock("start");
 	emittype(t->base);
 
 	/* allocate space for parameters */
@@ -530,14 +625,16 @@ mkfunc(struct decl *decl, char *name, struct type *t, struct scope *s)
 		}
 	}
 
+name:
 	t = mkarraytype(&typechar, QUALCONST, strlen(name) + 1);
-	d = mkdecl("__func__", DECLOBJECT, t, QUALNONE, LINKNONE);
+	d = mkdecl(intern("__func__", 8), DECLOBJECT, t, QUALNONE, LINKNONE);
 	d->u.obj.storage = SDSTATIC;
 	d->value = mkglobal(d);
 	scopeputdecl(s, d);
 	f->namedecl = d;
 
-	funclabel(f, mkblock("body"));
+	if (!syntaxonly)
+		funclabel(f, mkblock("body"));
 
 	return f;
 }
@@ -548,6 +645,8 @@ delfunc(struct func *f)
 	struct block *b;
 	struct inst **inst;
 
+	if (f->deferred)
+		return;
 	while (b = f->start) {
 		f->start = b->next;
 		arrayforeach (&b->insts, inst)
@@ -568,6 +667,8 @@ functype(struct func *f)
 void
 funclabel(struct func *f, struct block *b)
 {
+	if (syntaxonly)
+		return;
 	f->end->next = b;
 	f->end = b;
 }
@@ -577,6 +678,8 @@ funcjmp(struct func *f, struct block *l)
 {
 	struct block *b = f->end;
 
+	if (syntaxonly)
+		return;
 	if (!b->jump.kind) {
 		b->jump.kind = JUMP_JMP;
 		b->jump.blk[0] = l;
@@ -588,7 +691,7 @@ funcjnz(struct func *f, struct value *v, struct type *t, struct block *l1, struc
 {
 	struct block *b = f->end;
 
-	if (b->jump.kind)
+	if (syntaxonly || b->jump.kind)
 		return;
 	if (t) {
 		assert(t->prop & PROPSCALAR);
@@ -613,6 +716,8 @@ funcret(struct func *f, struct value *v)
 {
 	struct block *b = f->end;
 
+	if (syntaxonly)
+		return;
 	if (!b->jump.kind) {
 		b->jump.kind = JUMP_RET;
 		b->jump.arg = v;
@@ -624,7 +729,7 @@ funchlt(struct func *f)
 {
 	struct block *b = f->end;
 
-	if (!b->jump.kind)
+	if (!syntaxonly && !b->jump.kind)
 		b->jump.kind = JUMP_HLT;
 }
 
@@ -635,7 +740,7 @@ funcgoto(struct func *f, char *name)
 	struct gotolabel *g;
 	struct mapkey key;
 
-	mapkey(&key, name, strlen(name));
+	internkey(&key, name);
 	entry = mapput(&f->gotos, &key);
 	g = *entry;
 	if (!g) {
@@ -663,9 +768,9 @@ funclval(struct func *f, struct expr *e)
 		if (d->kind != DECLOBJECT && d->kind != DECLFUNC)
 			error(&tok.loc, "identifier '%s' is not an object or function", d->name);
 		if (d == f->namedecl) {
-			fputs("data ", stdout);
+			out("data ");
 			emitname(d->value);
-			printf(" = { b \"%s\", b 0 }\n", f->name);
+			outf(" = { b \"%s\", b 0 }\n", f->name);
 			f->namedecl = NULL;
 		}
 		lval.addr = d->value;
@@ -706,6 +811,9 @@ funcexpr(struct func *f, struct expr *e)
 	struct type *t, *functype;
 	size_t i;
 
+	if (syntaxonly)
+		return NULL;
+
 	calcvla(f, e->type);
 	switch (e->kind) {
 	case EXPRIDENT:
@@ -991,6 +1099,8 @@ funcinit(struct func *func, struct decl *d, struct init *init, bool hasinit)
 	unsigned long long offset = 0, max = 0;
 	size_t i, w;
 
+	if (syntaxonly)
+		return;
 	funcalloc(func, d);
 	if (!hasinit)
 		return;
@@ -1060,7 +1170,8 @@ casesearch(struct func *f, int class, struct value *v, struct switchcase *c, str
 void
 funcswitch(struct func *f, struct value *v, struct switchcases *c, struct block *defaultlabel)
 {
-	casesearch(f, qbetype(c->type).base, v, c->root, defaultlabel);
+	if (!syntaxonly)
+		casesearch(f, qbetype(c->type).base, v, c->root, defaultlabel);
 }
 
 /* emit */
@@ -1079,13 +1190,13 @@ emitname(struct value *v)
 	kind = v->kind & 0xf;
 	if (kind >= LEN(sigil) || !sigil[kind])
 		fatal("invalid value");
-	putchar(sigil[kind]);
+	outc(sigil[kind]);
 	if (kind == VALUE_GLOBAL && v->id)
-		fputs(".L", stdout);
+		out(".L");
 	if (v->u.name)
-		fputs(v->u.name, stdout);
+		out(v->u.name);
 	if (v->id)
-		printf(".%u", v->id);
+		outf(".%u", v->id);
 }
 
 static void
@@ -1093,17 +1204,17 @@ emitvalue(struct value *v)
 {
 	switch (v->kind & 0xf) {
 	case VALUE_INTCONST:
-		printf("%llu", v->u.i);
+		outf("%llu", v->u.i);
 		break;
 	case VALUE_FLTCONST:
-		printf("s_%.17g", v->u.f);
+		outf("s_%.17g", v->u.f);
 		break;
 	case VALUE_DBLCONST:
-		printf("d_%.17g", v->u.f);
+		outf("d_%.17g", v->u.f);
 		break;
 	case VALUE_GLOBAL:
 		if (v->kind & VALUE_THREAD)
-			fputs("thread ", stdout);
+			out("thread ");
 		/* fallthrough */
 	default:
 		emitname(v);
@@ -1117,7 +1228,7 @@ emitclass(int class, struct value *v)
 	if (v && v->kind == VALUE_TYPE)
 		emitname(v);
 	else if (class)
-		putchar(class);
+		outc(class);
 	else
 		fatal("type has no QBE representation");
 }
@@ -1126,7 +1237,6 @@ emitclass(int class, struct value *v)
 static void
 emittype(struct type *t)
 {
-	static unsigned id;
 	struct member *m, *other;
 	struct type *sub;
 	unsigned long long off;
@@ -1136,19 +1246,19 @@ emittype(struct type *t)
 	t->value = xmalloc(sizeof(*t->value));
 	t->value->kind = VALUE_TYPE;
 	t->value->u.name = t->u.structunion.tag;
-	t->value->id = ++id;
+	t->value->id = ++typeid;
 	for (m = t->u.structunion.members; m; m = m->next) {
 		for (sub = m->type; sub->kind == TYPEARRAY; sub = sub->base)
 			;
 		emittype(sub);
 	}
-	fputs("type ", stdout);
+	out("type ");
 	emitname(t->value);
 	if (t == targ->typevalist) {
-		printf(" = align %d { %llu }\n", t->align, t->size);
+		outf(" = align %d { %llu }\n", t->align, t->size);
 		return;
 	}
-	fputs(" = { ", stdout);
+	out(" = { ");
 	for (m = t->u.structunion.members, off = 0; m;) {
 		if (t->kind == TYPESTRUCT) {
 			/* look for a subsequent member with a larger storage unit */
@@ -1160,24 +1270,24 @@ emittype(struct type *t)
 			}
 			off = m->offset + m->type->size;
 		} else {
-			fputs("{ ", stdout);
+			out("{ ");
 		}
 		for (sub = m->type; sub->kind == TYPEARRAY; sub = sub->base)
 			;
 		emitclass(qbetype(sub).data, sub->value);
 		if (m->type->size > sub->size)
-			printf(" %llu", m->type->size / sub->size);
+			outf(" %llu", m->type->size / sub->size);
 		if (t->kind == TYPESTRUCT) {
-			fputs(", ", stdout);
+			out(", ");
 			/* skip subsequent members contained within the same storage unit */
 			do m = m->next;
 			while (m && m->offset < off);
 		} else {
-			fputs(" } ", stdout);
+			out(" } ");
 			m = m->next;
 		}
 	}
-	puts("}");
+	out("}\n");
 }
 
 static struct inst **
@@ -1186,26 +1296,26 @@ emitinst(struct inst **instp, struct inst **instend)
 	int op, first;
 	struct inst *inst = *instp;
 
-	putchar('\t');
+	outc('\t');
 	assert(inst->kind < LEN(instname));
 	if (inst->res.kind) {
 		emitvalue(&inst->res);
-		fputs(" =", stdout);
+		out(" =");
 		emitclass(inst->class, inst->arg[1]);
-		putchar(' ');
+		outc(' ');
 	}
-	fputs(instname[inst->kind], stdout);
-	putchar(' ');
+	out(instname[inst->kind]);
+	outc(' ');
 	emitvalue(inst->arg[0]);
 	++instp;
 	op = inst->kind;
 	switch (op) {
 	case ICALL:
-		putchar('(');
+		outc('(');
 		for (first = 1; instp != instend; ++instp) {
 			inst = *instp;
 			if (inst->kind == IVARARG) {
-				fputs(", ...", stdout);
+				out(", ...");
 				continue;
 			}
 			if (inst->kind != IARG)
@@ -1213,20 +1323,20 @@ emitinst(struct inst **instp, struct inst **instend)
 			if (first)
 				first = 0;
 			else
-				fputs(", ", stdout);
+				out(", ");
 			emitclass(inst->class, inst->arg[1]);
-			putchar(' ');
+			outc(' ');
 			emitvalue(inst->arg[0]);
 		}
-		putchar(')');
+		outc(')');
 		break;
 	default:
 		if (inst->arg[1]) {
-			fputs(", ", stdout);
+			out(", ");
 			emitvalue(inst->arg[1]);
 		}
 	}
-	putchar('\n');
+	outc('\n');
 	return instp;
 }
 
@@ -1237,37 +1347,37 @@ emitjump(struct jump *j)
 	case JUMP_NONE:
 		break;
 	case JUMP_RET:
-		fputs("\tret", stdout);
+		out("\tret");
 		if (j->arg) {
-			fputc(' ', stdout);
+			outc(' ');
 			emitvalue(j->arg);
 		}
-		putchar('\n');
+		outc('\n');
 		break;
 	case JUMP_JMP:
-		fputs("\tjmp ", stdout);
+		out("\tjmp ");
 		emitname(&j->blk[0]->label);
-		putchar('\n');
+		outc('\n');
 		break;
 	case JUMP_JNZ:
-		fputs("\tjnz ", stdout);
+		out("\tjnz ");
 		emitvalue(j->arg);
-		fputs(", ", stdout);
+		out(", ");
 		emitname(&j->blk[0]->label);
-		fputs(", ", stdout);
+		out(", ");
 		emitname(&j->blk[1]->label);
-		putchar('\n');
+		outc('\n');
 		break;
 	case JUMP_HLT:
-		fputs("\thlt\n", stdout);
+		out("\thlt\n");
 		break;
 	default:
 		assert(0);
 	}
 }
 
-void
-emitfunc(struct func *f, bool global)
+static void
+printfunc(struct func *f, bool global)
 {
 	struct block *b;
 	struct inst **inst, **instend;
@@ -1282,57 +1392,56 @@ emitfunc(struct func *f, bool global)
 		funcret(f, v);
 	}
 	if (global)
-		puts("export");
-	fputs("function ", stdout);
+		out("export\n");
+	out("function ");
 	if (f->type->base != &typevoid) {
 		emitclass(qbetype(f->type->base).base, f->type->base->value);
-		putchar(' ');
+		outc(' ');
 	}
 	emitname(f->decl->value);
-	putchar('(');
+	outc('(');
 	for (p = f->type->u.func.params, v = f->paramtemps; p; p = p->next, ++v) {
 		if (p != f->type->u.func.params)
-			fputs(", ", stdout);
+			out(", ");
 		emitclass(qbetype(p->type).base, p->type->value);
-		putchar(' ');
+		outc(' ');
 		emitname(v);
 	}
 	if (f->type->u.func.isvararg) {
 		if (f->type->u.func.params)
-			fputs(", ", stdout);
-		fputs("...", stdout);
+			out(", ");
+		out("...");
 	}
-	puts(") {");
+	out(") {\n");
 	for (b = f->start; b; b = b->next) {
 		emitname(&b->label);
-		putchar('\n');
+		outc('\n');
 		if (b->phi.res.kind) {
-			putchar('\t');
+			outc('\t');
 			emitvalue(&b->phi.res);
-			printf(" =%c phi ", b->phi.class);
+			outf(" =%c phi ", b->phi.class);
 			emitname(&b->phi.blk[0]->label);
-			putchar(' ');
+			outc(' ');
 			emitvalue(b->phi.val[0]);
-			fputs(", ", stdout);
+			out(", ");
 			emitname(&b->phi.blk[1]->label);
-			putchar(' ');
+			outc(' ');
 			emitvalue(b->phi.val[1]);
-			putchar('\n');
+			outc('\n');
 		}
 		instend = (struct inst **)((char *)b->insts.val + b->insts.len);
 		for (inst = b->insts.val; inst != instend;)
 			inst = emitinst(inst, instend);
 		emitjump(&b->jump);
 	}
-	puts("}");
+	out("}\n");
 }
 
+/* check that an evaluated initializer of static data is a constant */
 static void
-dataitem(struct expr *expr, unsigned long long size)
+dataconst(struct expr *expr)
 {
 	struct decl *decl;
-	size_t i, w;
-	unsigned c;
 
 	switch (expr->kind) {
 	case EXPRUNARY:
@@ -1344,52 +1453,73 @@ dataitem(struct expr *expr, unsigned long long size)
 		decl = expr->u.ident.decl;
 		if (decl->kind == DECLOBJECT && decl->u.obj.storage != SDSTATIC)
 			error(&tok.loc, "initializer is not a constant expression");
-		emitname(decl->value);
 		break;
 	case EXPRBINARY:
 		if (expr->op != TADD || expr->u.binary.l->kind != EXPRUNARY || expr->u.binary.r->kind != EXPRCONST)
 			error(&tok.loc, "initializer is not a constant expression");
+		dataconst(expr->u.binary.l);
+		break;
+	case EXPRCONST:
+	case EXPRSTRING:
+		break;
+	default:
+		error(&tok.loc, "initializer is not a constant expression");
+	}
+}
+
+/* print an initializer item checked by dataconst */
+static void
+dataitem(struct expr *expr, unsigned long long size)
+{
+	size_t i, w;
+	unsigned c;
+
+	switch (expr->kind) {
+	case EXPRUNARY:
+		emitname(expr->base->u.ident.decl->value);
+		break;
+	case EXPRBINARY:
 		dataitem(expr->u.binary.l, 0);
-		fputs(" + ", stdout);
+		out(" + ");
 		dataitem(expr->u.binary.r, 0);
 		break;
 	case EXPRCONST:
 		if (expr->type->prop & PROPFLOAT)
-			printf("%c_%.17g", expr->type->size == 4 ? 's' : 'd', expr->u.constant.f);
+			outf("%c_%.17g", expr->type->size == 4 ? 's' : 'd', expr->u.constant.f);
 		else
-			printf("%llu", expr->u.constant.u);
+			outf("%llu", expr->u.constant.u);
 		break;
 	case EXPRSTRING:
 		w = expr->type->base->size;
 		if (w == 1) {
-			fputc('"', stdout);
+			outc('"');
 			for (i = 0; i < expr->u.string.size && i < size; ++i) {
 				c = ((unsigned char *)expr->u.string.data)[i];
 				if (isprint(c) && c != '"' && c != '\\')
-					putchar(c);
+					outc(c);
 				else
-					printf("\\%03o", c);
+					outf("\\%03o", c);
 			}
-			fputc('"', stdout);
+			outc('"');
 		} else {
 			for (i = 0; i < expr->u.string.size && i * w < size; ++i) {
 				switch (w) {
-				case 2: printf("%" PRIuLEAST16 " ", ((uint_least16_t *)expr->u.string.data)[i]); break;
-				case 4: printf("%" PRIuLEAST32 " ", ((uint_least32_t *)expr->u.string.data)[i]); break;
+				case 2: outf("%" PRIuLEAST16 " ", ((uint_least16_t *)expr->u.string.data)[i]); break;
+				case 4: outf("%" PRIuLEAST32 " ", ((uint_least32_t *)expr->u.string.data)[i]); break;
 				default: assert(0);
 				}
 			}
 		}
 		if (i * w < size)
-			printf(", z %llu", size - (unsigned long long)i * w);
+			outf(", z %llu", size - (unsigned long long)i * w);
 		break;
 	default:
-		error(&tok.loc, "initializer is not a constant expression");
+		assert(0);
 	}
 }
 
-void
-emitdata(struct decl *d, struct init *init)
+static void
+printdata(struct decl *d, struct init *init)
 {
 	struct init *cur;
 	struct type *t;
@@ -1398,15 +1528,13 @@ emitdata(struct decl *d, struct init *init)
 	int align;
 
 	align = d->u.obj.align;
-	for (cur = init; cur; cur = cur->next)
-		cur->expr = eval(cur->expr);
 	if (d->u.obj.storage == SDTHREAD)
-		fputs("thread ", stdout);
+		out("thread ");
 	if (d->linkage == LINKEXTERN)
-		fputs("export ", stdout);
-	fputs("data ", stdout);
+		out("export ");
+	out("data ");
 	emitname(d->value);
-	printf(" = align %d { ", align);
+	outf(" = align %d { ", align);
 
 	while (init) {
 		cur = init;
@@ -1428,19 +1556,19 @@ emitdata(struct decl *d, struct init *init)
 		start = cur->start + cur->bits.before / 8;
 		end = cur->end - (cur->bits.after + 7) / 8;
 		if (offset < start && bits) {
-			printf("b %u, ", (unsigned)bits);  /* unfinished byte from previous bit-field */
+			outf("b %u, ", (unsigned)bits);  /* unfinished byte from previous bit-field */
 			++offset;
 			bits = 0;
 		}
 		if (offset < start)
-			printf("z %llu, ", start - offset);
+			outf("z %llu, ", start - offset);
 		if (cur->bits.before || cur->bits.after) {
 			/* little-endian target specific */
 			assert(cur->expr->type->prop & PROPINT);
 			assert(cur->expr->kind == EXPRCONST);
 			bits |= cur->expr->u.constant.u << cur->bits.before % 8;
 			for (offset = start; offset < end; ++offset, bits >>= 8)
-				printf("b %u, ", (unsigned)bits & 0xff);
+				outf("b %u, ", (unsigned)bits & 0xff);
 			/*
 			clear the upper `after` bits in the last byte,
 			or all bits when `after` is 0 (we ended on a
@@ -1451,18 +1579,291 @@ emitdata(struct decl *d, struct init *init)
 			t = cur->expr->type;
 			if (t->kind == TYPEARRAY)
 				t = t->base;
-			printf("%c ", qbetype(t).data);
+			outf("%c ", qbetype(t).data);
 			dataitem(cur->expr, cur->end - cur->start);
-			fputs(", ", stdout);
+			out(", ");
 		}
 		offset = end;
 	}
 	if (bits) {
-		printf("b %u, ", (unsigned)bits);
+		outf("b %u, ", (unsigned)bits);
 		++offset;
 	}
 	assert(offset <= d->type->size);
 	if (offset < d->type->size)
-		printf("z %llu ", d->type->size - offset);
-	puts("}");
+		outf("z %llu ", d->type->size - offset);
+	out("}\n");
+}
+
+/* whole program */
+
+void
+emitroot(char *name)
+{
+	arrayaddptr(&roots, name);
+}
+
+static void
+defer(struct value *v, struct func *f, struct decl *d, struct init *init, bool global)
+{
+	struct defn *defn;
+
+	defn = xmalloc(sizeof(*defn));
+	defn->value = v;
+	defn->func = f;
+	defn->decl = d;
+	defn->init = init;
+	defn->loc = f ? f->loc : tok.loc;
+	defn->global = global;
+	defn->reachable = false;
+	defn->next = NULL;
+	*defnsend = defn;
+	defnsend = &defn->next;
+}
+
+void
+emitfunc(struct func *f, bool global)
+{
+	if (syntaxonly)
+		return;
+	if (wholeprogram) {
+		f->deferred = true;
+		defer(f->decl->value, f, NULL, NULL, global);
+		return;
+	}
+	printfunc(f, global);
+}
+
+void
+emitdata(struct decl *d, struct init *init)
+{
+	struct init *cur;
+	struct expr *e;
+
+	for (cur = init; cur; cur = cur->next) {
+		cur->expr = eval(cur->expr);
+		dataconst(cur->expr);
+		/* eval turns the string literal of a string object into a reference to it */
+		if (wholeprogram && cur->expr->kind == EXPRSTRING) {
+			e = xmalloc(sizeof(*e));
+			*e = *cur->expr;
+			cur->expr = e;
+		}
+	}
+	if (syntaxonly)
+		return;
+	if (wholeprogram)
+		defer(d->value, NULL, d, init, false);
+	else
+		printdata(d, init);
+}
+
+/* the key of a global is its name as emitted, without the local prefix */
+static void
+globalkey(struct mapkey *k, struct value *v)
+{
+	static struct array buf;
+	char id[16];
+
+	buf.len = 0;
+	if (v->u.name)
+		arrayaddbuf(&buf, v->u.name, strlen(v->u.name));
+	if (v->id)
+		arrayaddbuf(&buf, id, sprintf(id, ".%u", v->id));
+	mapkey(k, buf.val, buf.len);
+}
+
+static void
+markvalue(struct map *defnmap, struct array *work, struct value *v)
+{
+	struct mapkey k;
+	struct defn *defn;
+
+	if (!v || (v->kind & 0xf) != VALUE_GLOBAL)
+		return;
+	globalkey(&k, v);
+	defn = mapget(defnmap, &k);
+	/* otherwise, it is defined outside the program */
+	if (defn && !defn->reachable) {
+		defn->reachable = true;
+		arrayaddptr(work, defn);
+	}
+}
+
+static void
+markexpr(struct map *defnmap, struct array *work, struct expr *e)
+{
+	switch (e->kind) {
+	case EXPRUNARY:
+		if (e->op == TBAND && e->base->kind == EXPRIDENT)
+			markvalue(defnmap, work, e->base->u.ident.decl->value);
+		break;
+	case EXPRBINARY:
+		markexpr(defnmap, work, e->u.binary.l);
+		break;
+	}
+}
+
+/* mark the definitions referenced by defn */
+static void
+markrefs(struct map *defnmap, struct array *work, struct defn *defn)
+{
+	struct block *b;
+	struct inst **inst;
+	struct init *init;
+
+	if (!defn->func) {
+		for (init = defn->init; init; init = init->next)
+			markexpr(defnmap, work, init->expr);
+		return;
+	}
+	for (b = defn->func->start; b; b = b->next) {
+		arrayforeach (&b->insts, inst) {
+			markvalue(defnmap, work, (*inst)->arg[0]);
+			markvalue(defnmap, work, (*inst)->arg[1]);
+		}
+		if (b->phi.res.kind) {
+			markvalue(defnmap, work, b->phi.val[0]);
+			markvalue(defnmap, work, b->phi.val[1]);
+		}
+		if (b->jump.kind == JUMP_JNZ || b->jump.kind == JUMP_RET)
+			markvalue(defnmap, work, b->jump.arg);
+	}
+}
+
+/*
+Emit the definitions of the whole program that are reachable from the
+roots, or from any definition with external linkage if there are no
+roots, in the order they were defined.
+*/
+void
+emitprogram(void)
+{
+	struct map defnmap;
+	struct array work = {0};
+	struct defn *defn, **item;
+	struct decl *d;
+	struct mapkey k;
+	void **entry;
+	char **root;
+
+	mapinit(&defnmap, 1024);
+	for (defn = defns; defn; defn = defn->next) {
+		globalkey(&k, defn->value);
+		k.str = memcpy(xmalloc(k.len), k.str, k.len);
+		entry = mapput(&defnmap, &k);
+		/* names with internal linkage are unique, so only external ones collide */
+		if (*entry) {
+			d = defn->func ? defn->func->decl : defn->decl;
+			error(&defn->loc, "'%s' is defined in more than one translation unit", d->name);
+		}
+		*entry = defn;
+	}
+	if (roots.len) {
+		arrayforeach (&roots, root) {
+			mapkey(&k, *root, strlen(*root));
+			defn = mapget(&defnmap, &k);
+			if (defn && !defn->reachable) {
+				defn->reachable = true;
+				arrayaddptr(&work, defn);
+			}
+		}
+	} else {
+		for (defn = defns; defn; defn = defn->next) {
+			if ((defn->func ? defn->func->decl : defn->decl)->linkage == LINKEXTERN) {
+				defn->reachable = true;
+				arrayaddptr(&work, defn);
+			}
+		}
+	}
+	while (work.len) {
+		work.len -= sizeof(defn);
+		item = (struct defn **)((char *)work.val + work.len);
+		markrefs(&defnmap, &work, *item);
+	}
+	for (defn = defns; defn; defn = defn->next) {
+		if (!defn->reachable)
+			continue;
+		if (defn->func)
+			printfunc(defn->func, defn->global);
+		else
+			printdata(defn->decl, defn->init);
+	}
+}
+
+/* reset the emitted names and types before the next translation unit */
+void
+emitreset(void)
+{
+	if (internids.len)
+		mapfree(&internids, free);
+	internids.len = 0;
+	/* names and types must stay unique within the whole program */
+	if (wholeprogram)
+		return;
+	blockid = 0;
+	globalid = 0;
+	typeid = 0;
+	/* the only aggregate type shared between translation units */
+	targ->typevalist->value = NULL;
+}
+
+/* values of global names and aggregate types, for a precompiled header */
+void
+emitsavevalue(struct pch *p, size_t slot, struct value *v)
+{
+	size_t off;
+	bool new;
+
+	if (!v) {
+		pchptr(p, slot, 0);
+		return;
+	}
+	off = pchobj(p, v, sizeof(*v), &new);
+	pchptr(p, slot, off);
+	if (!new)
+		return;
+	switch (v->kind & 0xf) {
+	case VALUE_GLOBAL:
+	case VALUE_TYPE:
+	case VALUE_LABEL:
+		pchident(p, off + offsetof(struct value, u.name), v->u.name);
+		break;
+	}
+}
+
+/* the name counters, and the types that are not saved with the declarations */
+struct emitstate {
+	unsigned blockid, globalid, typeid;
+	struct value *valist, *valistbase;
+};
+
+size_t
+emitsave(struct pch *p)
+{
+	struct emitstate *st;
+	size_t off;
+
+	off = pchobj(p, NULL, sizeof(*st), NULL);
+	st = pchat(p, off);
+	st->blockid = blockid;
+	st->globalid = globalid;
+	st->typeid = typeid;
+	emitsavevalue(p, off + offsetof(struct emitstate, valist), targ->typevalist->value);
+	if (targ->typevalist->base)
+		emitsavevalue(p, off + offsetof(struct emitstate, valistbase), targ->typevalist->base->value);
+	return off;
+}
+
+void
+emitload(void *state)
+{
+	struct emitstate *st = state;
+
+	blockid = st->blockid;
+	globalid = st->globalid;
+	typeid = st->typeid;
+	targ->typevalist->value = st->valist;
+	if (targ->typevalist->base)
+		targ->typevalist->base->value = st->valistbase;
 }
@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "cc.h"
+
+/*
+The include report charges the work done for a translation unit to the
+source files it came from. The files form a tree, following the
+inclusions seen by the preprocessor, or described by the line markers
+of preprocessed input. Tokens are charged to the file they were scanned
+from, and the declarations, function definitions and output of an
+external declaration to the file it began in.
+
+The bytes of QBE IL are counted as they are written, and charged like
+declarations, or to the file being scanned when the IL is written
+outside of an external declaration, such as for tentative definitions.
+
+The root of the tree is the translation unit, named by the last file
+entered at the top level. For preprocessed input, that is the source
+file named by the line markers, rather than standard input.
+*/
+
+struct reportfile {
+	/* interned, so that names can be compared by pointer */
+	char *name;
+	struct reportfile *parent, *child, **childend, *next;
+	/* counts of the file itself, and including the files it includes */
+	unsigned long long self[NREPORT], total[NREPORT];
+};
+
+bool includereport;
+
+static struct reportfile root = {.childend = &root.child};
+/* the file being scanned, and the file the current external declaration began in */
+static struct reportfile *cur = &root, *target;
+
+static struct reportfile *
+newfile(struct reportfile *parent, char *name)
+{
+	struct reportfile *f;
+
+	f = xmalloc(sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	f->name = name;
+	f->parent = parent;
+	f->childend = &f->child;
+	*parent->childend = f;
+	parent->childend = &f->next;
+	return f;
+}
+
+/*
+Switch to the file called name. With REPORTLEAVE, it is the file that
+the current file was included by, or if name is NULL, that file
+regardless of its name.
+*/
+void
+reportfile(const char *name, enum reportmove move)
+{
+	struct reportfile *parent, *f;
+	char *s;
+
+	if (move == REPORTLEAVE) {
+		if (cur != &root)
+			cur = cur->parent;
+		if (!name)
+			return;
+	}
+	s = intern(name, strlen(name));
+	if (move == REPORTENTER) {
+		cur = newfile(cur, s);
+		return;
+	}
+	if (cur->name == s)
+		return;
+	if (cur == &root) {
+		root.name = s;
+		return;
+	}
+	/* a file that is returned to again continues where it left off */
+	parent = cur->parent;
+	for (f = parent->child; f && f->name != s; f = f->next)
+		;
+	cur = f ? f : newfile(parent, s);
+}
+
+void
+reportadd(enum reportkind kind, unsigned long long n)
+{
+	if (kind == REPORTTOKENS || !target)
+		cur->self[kind] += n;
+	else
+		target->self[kind] += n;
+}
+
+/* begin an external declaration in the file being scanned */
+void
+reportbegin(void)
+{
+	target = cur;
+}
+
+void
+reportend(void)
+{
+	target = NULL;
+}
+
+static void
+sum(struct reportfile *f)
+{
+	struct reportfile *c;
+	int i;
+
+	memcpy(f->total, f->self, sizeof(f->total));
+	for (c = f->child; c; c = c->next) {
+		sum(c);
+		for (i = 0; i < NREPORT; ++i)
+			f->total[i] += c->total[i];
+	}
+}
+
+static void
+printcounts(unsigned long long *n)
+{
+	fprintf(stderr, "%10llu %7llu %6llu %9llu  ", n[REPORTTOKENS], n[REPORTDECLS], n[REPORTFUNCS], n[REPORTBYTES]);
+}
+
+static void
+printfile(struct reportfile *f, int depth)
+{
+	struct reportfile *c, *next;
+
+	printcounts(f->self);
+	printcounts(f->total);
+	fprintf(stderr, "%*s%s\n", depth * 2, "", f->name);
+	for (c = f->child; c; c = next) {
+		next = c->next;
+		printfile(c, depth + 1);
+		free(c);
+	}
+}
+
+/*
+Print the tree of files of the translation unit to stderr, with the
+counts of each file by itself and including the files it includes, and
+start over for the next translation unit.
+*/
+void
+reportprint(void)
+{
+	if (!root.name)
+		root.name = (char *)scanpath();
+	fprintf(stderr, "%s: %s: include report\n", argv0, root.name);
+	fprintf(stderr, "%-37s%s\n", "exclusive", "inclusive");
+	fprintf(stderr, "%10s %7s %6s %9s  %10s %7s %6s %9s  %s\n", "tokens", "decls", "funcs", "bytes", "tokens", "decls", "funcs", "bytes", "file");
+	sum(&root);
+	printfile(&root, 0);
+	memset(&root, 0, sizeof(root));
+	root.childend = &root.child;
+	cur = &root;
+}
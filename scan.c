@@ -1,9 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "util.h"
 #include "cc.h"
 
@@ -12,17 +21,72 @@ struct buffer {
 	size_t len, cap;
 };
 
+/*
+A token in the token cache. Locations are those in the file, before
+any #line directive. The literal of an identifier is an index into the
+identifier table, and that of any other token is one more than the
+offset of its text, or 0 if it has none.
+
+A header name following #include or #include_next is recorded as a
+TNONE token with its text, and the number of tokens that follow for
+the same text in place of the column.
+*/
+struct cachedtoken {
+	uint32_t line;
+	uint32_t lit;
+	uint16_t col;
+	unsigned char kind;
+	unsigned char space;
+};
+
+/* the tokens of a file, followed by the identifier offsets and text */
+struct cachedfile {
+	uint32_t ntoken, nident, textlen;
+};
+
 struct scanner {
 	int chr;
 	bool usebuf;
 	bool sawspace;
-	FILE *file;
+	/* whether the end of this input ends an #include */
+	bool include;
+	/* name the input was opened with */
+	const char *path;
+	/* contents of the input, or NULL if it has not been read yet */
+	unsigned char *data, *pos, *end;
+	/* length of the mapping holding the contents, or 0 if they were allocated */
+	size_t maplen;
 	struct location loc;
 	struct buffer buf;
+	/* where to go on a malformed token, instead of reporting it */
+	jmp_buf *fail;
+	/* tokens replayed from the token cache, if not NULL */
+	const struct cachedtoken *token, *tokenbegin;
+	const char *text;
+	char **ident;
+	/* copy of the cached tokens built from this input, if any */
+	void *cache;
+	/* difference of #line numbers from the lines of the cached tokens */
+	size_t linedelta;
+	/* whether the next token follows scanskip(), which does not note whitespace */
+	bool skipped;
 	struct scanner *next;
 };
 
+/* character classes for the fast paths of the scanner */
+enum {
+	SPACE = 1<<0,  /* horizontal whitespace */
+	IDENT = 1<<1,  /* identifier character */
+	LINE  = 1<<2,  /* within a C++-style comment */
+	BLOCK = 1<<3,  /* within a C-style comment, but not '*' */
+};
+
 static struct scanner *scanner;
+static unsigned char charclass[256];
+/* arena holding the text of token literals, which are never freed */
+static struct {
+	char *pos, *end;
+} text;
 
 static void
 bufadd(struct buffer *b, int c)
@@ -34,44 +98,168 @@ bufadd(struct buffer *b, int c)
 	b->str[b->len++] = c;
 }
 
+static void
+bufaddn(struct buffer *b, const unsigned char *str, size_t len)
+{
+	if (len > b->cap - b->len) {
+		if (!b->cap)
+			b->cap = 1<<8;
+		while (len > b->cap - b->len)
+			b->cap *= 2;
+		b->str = xreallocarray(b->str, b->cap, 1);
+	}
+	memcpy(b->str + b->len, str, len);
+	b->len += len;
+}
+
+/* copy len bytes of str to the literal arena */
+static char *
+textcopy(const void *str, size_t len)
+{
+	char *s;
+	size_t n;
+
+	if (len > text.end - text.pos) {
+		n = len > 1<<16 ? len : 1<<16;
+		text.pos = xmalloc(n);
+		text.end = text.pos + n;
+	}
+	s = text.pos;
+	memcpy(s, str, len);
+	text.pos += len;
+
+	return s;
+}
+
 static char *
 bufget(struct buffer *b)
 {
 	char *s;
 
 	bufadd(b, '\0');
-	s = xmalloc(b->len);
-	memcpy(s, b->str, b->len);
+	s = textcopy(b->str, b->len);
 	b->len = 0;
 
 	return s;
 }
 
+/* report a malformed token, or abandon the token cache for the input */
 static void
-nextchar(struct scanner *s)
+lexerror(struct scanner *s, const char *msg)
 {
-	int c;
+	if (s->fail)
+		longjmp(*s->fail, 1);
+	error(&s->loc, "%s", msg);
+}
 
+static void
+nextchar(struct scanner *s)
+{
 	if (s->usebuf)
 		bufadd(&s->buf, s->chr);
 	for (;;) {
-		s->chr = getc(s->file);
+		if (s->pos == s->end) {
+			s->chr = EOF;
+			++s->loc.col;
+			break;
+		}
+		s->chr = *s->pos++;
 		if (s->chr == '\n') {
 			++s->loc.line, s->loc.col = 0;
 			break;
 		}
 		++s->loc.col;
-		if (s->chr != '\\')
-			break;
-		c = getc(s->file);
-		if (c != '\n') {
-			ungetc(c, s->file);
+		if (s->chr != '\\' || s->pos == s->end || *s->pos != '\n')
 			break;
-		}
+		++s->pos;
 		++s->loc.line, s->loc.col = 0;
 	}
 }
 
+/* a word with every byte set to 0x01, and to 0x80 */
+#define ONES  ((uint64_t)-1 / 0xff)
+#define HIGHS (ONES * 0x80)
+
+/*
+Returns a word with the high bit set in each byte of x equal to c. No
+carry crosses a byte, so unlike the usual zero byte test, every byte is
+exact, not just the first.
+*/
+static uint64_t
+byteeq(uint64_t x, int c)
+{
+	x ^= ONES * c;
+	return ~(((x & ~HIGHS) + ~HIGHS) | x) & HIGHS;
+}
+
+/* the high bit of each byte of x that ends a comment run in class */
+static uint64_t
+runends(uint64_t x, int class)
+{
+	switch (class) {
+	case LINE:
+		return byteeq(x, '\n') | byteeq(x, '\\');
+	case BLOCK:
+		return byteeq(x, '\n') | byteeq(x, '\\') | byteeq(x, '*');
+	}
+	return HIGHS;
+}
+
+/*
+Skip whole words of a comment run in class from p, returning the end of
+the run if it is found, or the start of the last partial word.
+*/
+static unsigned char *
+skipwords(unsigned char *p, unsigned char *end, int class)
+{
+	uint64_t x;
+
+	for (; end - p >= 8; p += 8) {
+		/* byte i of the input is byte i of x, whatever the byte order */
+		x = (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+		  | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+		x = runends(x, class);
+		if (x) {
+			/* keep the low bit of each byte before the first end, and add them up */
+			x = ((x & -x) - 1) & ONES;
+			return p + (x * ONES >> 56) - 1;
+		}
+	}
+	return p;
+}
+
+/*
+Advance to the last character of a run of characters in class starting
+at the current character, without going through nextchar() for each
+of them. None of the classes contain '\n' or '\\', so the run has no
+line splices, and only the column changes.
+*/
+static void
+skiprun(struct scanner *s, int class)
+{
+	unsigned char *p;
+	size_t n;
+
+	if (s->chr == EOF || !(charclass[s->chr] & class))
+		return;
+	p = s->pos;
+	/* comments are long enough to skip a word at a time */
+	if (class & (LINE | BLOCK))
+		p = skipwords(p, s->end, class);
+	for (; p != s->end && charclass[*p] & class; ++p)
+		;
+	n = p - s->pos;
+	if (n == 0)
+		return;
+	if (s->usebuf) {
+		bufadd(&s->buf, s->chr);
+		bufaddn(&s->buf, s->pos, n - 1);
+	}
+	s->chr = p[-1];
+	s->pos = p;
+	s->loc.col += n;
+}
+
 static int
 op2(struct scanner *s, int t1, int t2)
 {
@@ -123,8 +311,10 @@ static int
 ident(struct scanner *s)
 {
 	s->usebuf = true;
-	while (isalnum(s->chr) || s->chr == '_')
+	while (isalnum(s->chr) || s->chr == '_') {
+		skiprun(s, IDENT);
 		nextchar(s);
+	}
 
 	return TIDENT;
 }
@@ -176,7 +366,7 @@ escape(struct scanner *s)
 	if (s->chr == 'x') {
 		nextchar(s);
 		if (!isxdigit(s->chr))
-			error(&s->loc, "invalid hexadecimal escape sequence");
+			lexerror(s, "invalid hexadecimal escape sequence");
 		do nextchar(s);
 		while (isxdigit(s->chr));
 	} else if (isodigit(s->chr)) {
@@ -189,7 +379,7 @@ escape(struct scanner *s)
 	} else if (strchr("'\"?\\abfnrtv", s->chr)) {
 		nextchar(s);
 	} else {
-		error(&s->loc, "invalid escape sequence");
+		lexerror(s, "invalid escape sequence");
 	}
 }
 
@@ -207,9 +397,9 @@ charconst(struct scanner *s)
 			nextchar(s);
 			return TCHARCONST;
 		case '\n':
-			error(&s->loc, "newline in character constant");
+			lexerror(s, "newline in character constant");
 		case EOF:
-			error(&s->loc, "EOF in character constant");
+			lexerror(s, "EOF in character constant");
 		default:
 			nextchar(s);
 			break;
@@ -231,9 +421,9 @@ stringlit(struct scanner *s)
 			nextchar(s);
 			return TSTRINGLIT;
 		case '\n':
-			error(&s->loc, "newline in string literal");
+			lexerror(s, "newline in string literal");
 		case EOF:
-			error(&s->loc, "EOF in string literal");
+			lexerror(s, "EOF in string literal");
 		default:
 			nextchar(s);
 			break;
@@ -248,16 +438,19 @@ comment(struct scanner *s)
 
 	switch (s->chr) {
 	case '/':  /* C++-style comment */
-		do nextchar(s);
-		while (s->chr != '\n' && s->chr != EOF);
+		do {
+			skiprun(s, LINE);
+			nextchar(s);
+		} while (s->chr != '\n' && s->chr != EOF);
 		break;
 	case '*':  /* C-style comment */
 		nextchar(s);
 		do {
+			skiprun(s, BLOCK);
 			last = s->chr;
 			nextchar(s);
 			if (s->chr == EOF)
-				error(&s->loc, "EOF in comment");
+				lexerror(s, "EOF in comment");
 		} while (last != '*' || s->chr != '/');
 		nextchar(s);
 		break;
@@ -273,6 +466,7 @@ scankind(struct scanner *s, struct location *loc)
 {
 	enum tokenkind tok;
 	struct location oldloc;
+	unsigned char *oldpos;
 
 again:
 	*loc = s->loc;
@@ -282,6 +476,7 @@ again:
 	case '\f':
 	case '\v':
 		s->sawspace = true;
+		skiprun(s, SPACE);
 		nextchar(s);
 		goto again;
 	case '!':
@@ -355,9 +550,10 @@ again:
 		if (s->chr != '.')
 			return TPERIOD;
 		oldloc = s->loc;
+		oldpos = s->pos;
 		nextchar(s);
 		if (s->chr != '.') {
-			ungetc(s->chr, s->file);
+			s->pos = oldpos;
 			s->loc = oldloc;
 			s->chr = '.';
 			return TPERIOD;
@@ -407,13 +603,105 @@ again:
 	}
 }
 
+/*
+Read the entire input into memory, so that the scanner only has to
+walk a pointer through it instead of going through stdio for every
+character. Regular files are mapped, and anything else, such as a
+pipe from an external preprocessor, is read in large blocks.
+
+Line splices are handled as they are reached by nextchar(). Finding
+them in advance would not save anything, since the check for one is a
+single comparison with the character just read.
+*/
+static void
+readfile(struct scanner *s, FILE *file)
+{
+	struct stat st;
+	size_t len, cap;
+	ssize_t n;
+	void *map;
+	int fd;
+
+	fd = fileno(file);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			s->data = map;
+			s->maplen = st.st_size;
+			len = st.st_size;
+			goto done;
+		}
+	}
+	len = 0;
+	cap = 1<<16;
+	s->data = xmalloc(cap);
+	for (;;) {
+		if (len == cap) {
+			cap *= 2;
+			s->data = xreallocarray(s->data, cap, 1);
+		}
+		n = read(fd, s->data + len, cap - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("read %s:", s->loc.file);
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+done:
+	fclose(file);
+	s->pos = s->data;
+	s->end = s->data + len;
+	nextchar(s);
+}
+
+/* release the contents of the input */
+static void
+freedata(struct scanner *s)
+{
+	if (s->maplen)
+		munmap(s->data, s->maplen);
+	else
+		free(s->data);
+	s->data = NULL;
+	s->maplen = 0;
+}
+
+static void
+initclass(void)
+{
+	int c;
+
+	for (c = 0; c < 256; ++c) {
+		if (isalnum(c) || c == '_')
+			charclass[c] |= IDENT;
+		if (c != '\n' && c != '\\') {
+			charclass[c] |= LINE;
+			if (c != '*')
+				charclass[c] |= BLOCK;
+		}
+	}
+	charclass[' '] |= SPACE;
+	charclass['\t'] |= SPACE;
+	charclass['\f'] |= SPACE;
+	charclass['\v'] |= SPACE;
+}
+
 void
 scanfrom(const char *name, FILE *file)
 {
 	struct scanner *s;
 
+	if (!charclass['_'])
+		initclass();
+
 	s = xmalloc(sizeof(*s));
-	s->file = file;
+	s->data = NULL;
+	s->maplen = 0;
+	s->include = false;
+	s->path = name;
 	s->buf.str = NULL;
 	s->buf.len = 0;
 	s->buf.cap = 0;
@@ -421,50 +709,527 @@ scanfrom(const char *name, FILE *file)
 	s->loc.file = name;
 	s->loc.line = 1;
 	s->loc.col = 0;
+	s->fail = NULL;
+	s->token = NULL;
+	s->ident = NULL;
+	s->cache = NULL;
+	s->linedelta = 0;
+	s->skipped = false;
 	s->next = scanner;
 	if (file)
-		nextchar(s);
+		readfile(s, file);
 	scanner = s;
 }
 
+/* scan a header name to the buffer, if there is one */
+static bool
+headername(struct scanner *s)
+{
+	int end;
+
+	while (s->chr == ' ' || s->chr == '\t')
+		nextchar(s);
+	switch (s->chr) {
+	case '<': end = '>'; break;
+	case '"': end = '"'; break;
+	default: return false;
+	}
+	s->usebuf = true;
+	do nextchar(s);
+	while (s->chr != end && s->chr != '\n' && s->chr != EOF);
+	if (s->chr != end)
+		lexerror(s, "unterminated header name");
+	nextchar(s);
+	s->usebuf = false;
+	return true;
+}
+
+/* the cached tokens being built for an input */
+static struct {
+	struct array token, ident, text;
+	/* index of each interned identifier, by address */
+	void *ids;
+} rec;
+
+struct cachedident {
+	struct treenode node;
+	uint32_t index;
+};
+
+/* add the literal text of a token, returning its offset plus one */
+static uint32_t
+recordtext(struct scanner *s, const void *str, size_t len)
+{
+	size_t off;
+
+	off = rec.text.len;
+	if (len >= UINT32_MAX - off)
+		longjmp(*s->fail, 1);
+	arrayaddbuf(&rec.text, str, len);
+	arrayaddbuf(&rec.text, "", 1);
+	return off + 1;
+}
+
+/* scan the next token into the cache, returning its index */
+static size_t
+recordtoken(struct scanner *s)
+{
+	struct cachedtoken *t;
+	struct cachedident *id;
+	struct location loc;
+	char *name;
+	size_t i;
+
+	s->sawspace = false;
+	i = rec.token.len / sizeof(*t);
+	t = arrayadd(&rec.token, sizeof(*t));
+	t->kind = scankind(s, &loc);
+	if (loc.line > UINT32_MAX || loc.col > UINT16_MAX)
+		longjmp(*s->fail, 1);
+	t->line = loc.line;
+	t->col = loc.col;
+	t->space = s->sawspace;
+	t->lit = 0;
+	if (t->kind == TIDENT) {
+		name = intern((char *)s->buf.str, s->buf.len);
+		id = treeinsert(&rec.ids, (uintptr_t)name, sizeof(*id));
+		if (id->node.new) {
+			id->index = rec.ident.len / sizeof(uint32_t);
+			*(uint32_t *)arrayadd(&rec.ident, sizeof(uint32_t)) = recordtext(s, name, s->buf.len) - 1;
+		}
+		t->lit = id->index;
+	} else if (s->usebuf) {
+		t->lit = recordtext(s, s->buf.str, s->buf.len);
+	}
+	s->buf.len = 0;
+	s->usebuf = false;
+	return i;
+}
+
+/*
+Record the header name of an #include or #embed directive, if there is one, and
+then the tokens scanned from the same text, which are used instead if
+the directive is not processed as an #include.
+*/
+static void
+recordheadername(struct scanner *s)
+{
+	struct cachedtoken *t;
+	struct location loc;
+	unsigned char *pos, *end;
+	size_t i, n;
+	int chr;
+
+	chr = s->chr;
+	pos = s->pos;
+	loc = s->loc;
+	if (!headername(s))
+		return;
+	i = rec.token.len / sizeof(*t);
+	t = arrayadd(&rec.token, sizeof(*t));
+	t->kind = TNONE;
+	t->space = false;
+	t->line = 0;
+	t->lit = recordtext(s, s->buf.str, s->buf.len);
+	s->buf.len = 0;
+	end = s->pos;
+	s->chr = chr;
+	s->pos = pos;
+	s->loc = loc;
+	for (n = 0; s->pos < end; ++n)
+		recordtoken(s);
+	/* the header name must end at a token boundary */
+	if (s->pos != end || n > UINT16_MAX)
+		longjmp(*s->fail, 1);
+	((struct cachedtoken *)rec.token.val)[i].col = n;
+}
+
+/* start over at the beginning of the input */
+static void
+restart(struct scanner *s)
+{
+	s->pos = s->data;
+	s->loc.line = 1;
+	s->loc.col = 0;
+	s->buf.len = 0;
+	s->usebuf = false;
+	nextchar(s);
+}
+
+/*
+Scan all of the input to the cached form, with the size in *size. The
+tokens of excluded groups are scanned too, so the input is not cached
+if any of its tokens are malformed, or if it is too large.
+*/
+static void *
+record(struct scanner *s, size_t *size)
+{
+	jmp_buf fail;
+	struct cachedfile *f;
+	struct cachedtoken *t;
+	enum tokenkind kind;
+	char *buf, *name;
+	bool bol, hash;
+	size_t i;
+
+	rec.token.len = 0;
+	rec.ident.len = 0;
+	rec.text.len = 0;
+	rec.ids = NULL;
+	if (setjmp(fail)) {
+		s->fail = NULL;
+		restart(s);
+		return NULL;
+	}
+	s->fail = &fail;
+	bol = true;
+	hash = false;
+	do {
+		i = recordtoken(s);
+		t = (struct cachedtoken *)rec.token.val + i;
+		kind = t->kind;
+		if (hash && kind == TIDENT) {
+			name = (char *)rec.text.val + ((uint32_t *)rec.ident.val)[t->lit];
+			if (strcmp(name, "include") == 0 || strcmp(name, "include_next") == 0 || strcmp(name, "embed") == 0)
+				recordheadername(s);
+		}
+		hash = bol && kind == THASH;
+		bol = kind == TNEWLINE;
+	} while (kind != TEOF);
+	s->fail = NULL;
+
+	*size = sizeof(*f) + rec.token.len + rec.ident.len + rec.text.len;
+	buf = xmalloc(*size);
+	f = (struct cachedfile *)buf;
+	f->ntoken = rec.token.len / sizeof(*t);
+	f->nident = rec.ident.len / sizeof(uint32_t);
+	f->textlen = rec.text.len;
+	buf += sizeof(*f);
+	memcpy(buf, rec.token.val, rec.token.len);
+	buf += rec.token.len;
+	memcpy(buf, rec.ident.val, rec.ident.len);
+	buf += rec.ident.len;
+	memcpy(buf, rec.text.val, rec.text.len);
+	return f;
+}
+
+/* check the cached form of the input, and set up the scanner to replay it */
+static bool
+loadcache(struct scanner *s, const void *cache, size_t size)
+{
+	const struct cachedfile *f = cache;
+	const struct cachedtoken *t, *end;
+	const uint32_t *ident;
+	const char *text;
+	uint32_t i;
+
+	if (size < sizeof(*f) || f->ntoken == 0)
+		return false;
+	if (size - sizeof(*f) != (size_t)f->ntoken * sizeof(*t) + (size_t)f->nident * sizeof(*ident) + f->textlen)
+		return false;
+	t = (const struct cachedtoken *)(f + 1);
+	end = t + f->ntoken;
+	ident = (const uint32_t *)end;
+	text = (const char *)(ident + f->nident);
+	if (end[-1].kind != TEOF || f->textlen > 0 && text[f->textlen - 1] != '\0')
+		return false;
+	for (i = 0; i < f->nident; ++i) {
+		if (ident[i] >= f->textlen)
+			return false;
+	}
+	for (; t < end; ++t) {
+		if (t->kind > THASHHASH || (t->kind == TIDENT ? t->lit >= f->nident : t->lit > f->textlen))
+			return false;
+		if ((t->kind == TNONE || t->kind == TOTHER) && t->lit == 0)
+			return false;
+		if (t->kind == TNONE && t->col >= end - t - 1)
+			return false;
+	}
+	s->ident = xreallocarray(NULL, f->nident, sizeof(s->ident[0]));
+	for (i = 0; i < f->nident; ++i)
+		s->ident[i] = intern(text + ident[i], strlen(text + ident[i]));
+	s->token = (const struct cachedtoken *)(f + 1);
+	s->tokenbegin = s->token;
+	s->text = text;
+	return true;
+}
+
+/* replay the tokens of the input from the token cache, adding them if necessary */
+static void
+usecache(struct scanner *s)
+{
+	const void *cache;
+	size_t size;
+
+	cache = tokcacheget(s->path, s->data, s->end - s->data, &size);
+	if (!cache) {
+		s->cache = record(s, &size);
+		if (!s->cache)
+			return;
+		tokcacheput(s->path, s->data, s->end - s->data, s->cache, size);
+		cache = s->cache;
+	}
+	if (!loadcache(s, cache, size)) {
+		free(s->cache);
+		s->cache = NULL;
+		restart(s);
+		return;
+	}
+	freedata(s);
+}
+
+/* start scanning an included file; scan() returns TEOF at its end */
+void
+scaninclude(const char *name, FILE *file)
+{
+	scanfrom(name, file);
+	scanner->include = true;
+	if (file && tokcachedir)
+		usecache(scanner);
+}
+
+/* start scanning a copy of text in memory; scan() returns TEOF at its end */
+void
+scanbuf(const char *name, const char *text, size_t len)
+{
+	struct scanner *s;
+
+	scaninclude(name, NULL);
+	s = scanner;
+	s->data = xmalloc(len + 1);
+	memcpy(s->data, text, len);
+	s->pos = s->data;
+	s->end = s->data + len;
+	nextchar(s);
+}
+
+/* get the name of the file being scanned, unaffected by #line */
+const char *
+scanpath(void)
+{
+	return scanner->path;
+}
+
+/* scan the header name of an #include or #embed directive, if there is one */
+char *
+scanheadername(void)
+{
+	struct scanner *s = scanner;
+	const struct cachedtoken *t;
+	const char *text;
+	char *name;
+
+	if (s->token) {
+		t = s->token;
+		if (t->kind != TNONE)
+			return NULL;
+		text = s->text + t->lit - 1;
+		name = textcopy(text, strlen(text) + 1);
+		/* skip the tokens scanned from the same text */
+		s->token += 1 + t->col;
+		return name;
+	}
+	if (!headername(s))
+		return NULL;
+	return bufget(&s->buf);
+}
+
 void
 scanopen(void)
 {
-	if (!scanner->file) {
-		scanner->file = fopen(scanner->loc.file, "r");
-		if (!scanner->file)
+	FILE *file;
+
+	if (!scanner->data) {
+		file = fopen(scanner->loc.file, "r");
+		if (!file)
 			fatal("open %s:", scanner->loc.file);
-		nextchar(scanner);
+		readfile(scanner, file);
 	}
+	if (includereport)
+		reportfile(scanner->path, REPORTSWITCH);
 }
 
 void
 scansetloc(struct location loc)
 {
-	scanner->loc = loc;
+	struct scanner *s = scanner;
+
+	/* the next line of the file is the one after the last token */
+	if (s->token && s->token != s->tokenbegin)
+		s->linedelta = loc.line - s->token[-1].line;
+	s->loc = loc;
+	/* a newline that was already read counts toward the line after it */
+	if (!s->token && s->chr == '\n')
+		++s->loc.line, s->loc.col = 0;
 }
 
-static void
+/*
+Skip the rest of an excluded conditional group, up to the next line
+that begins with '#', or the end of the input. The skipped text is not
+split into tokens; only comments and quotes are recognized, so that a
+'#' inside them does not start a directive.
+*/
+void
+scanskip(void)
+{
+	struct scanner *s = scanner;
+	unsigned char *p, *end, *line;
+	const struct cachedtoken *t;
+	bool bol;
+	int q;
+
+	if (s->token) {
+		bol = s->token == s->tokenbegin || s->token[-1].kind == TNEWLINE;
+		for (t = s->token; t->kind != TEOF; ++t) {
+			if (bol && (t->kind == THASH || t->kind == THASHHASH))
+				break;
+			/* carriage returns are skipped like whitespace, as below */
+			if (t->kind == TNEWLINE)
+				bol = true;
+			else if (t->kind != TOTHER || strcmp(s->text + t->lit - 1, "\r") != 0)
+				bol = false;
+		}
+		s->token = t;
+		s->skipped = true;
+		return;
+	}
+	p = s->pos;
+	end = s->end;
+	if (s->chr == '\n') {
+		bol = true;
+	} else if (s->chr != EOF) {
+		--p;
+		bol = s->loc.col <= 1;
+	} else {
+		return;
+	}
+	line = p - (bol ? 0 : s->loc.col - 1);
+	while (p != end) {
+		switch (*p++) {
+		case '\n':
+			++s->loc.line;
+			line = p;
+			bol = true;
+			continue;
+		case '\\':
+			if (p != end && *p == '\n') {
+				++p;
+				++s->loc.line;
+				line = p;
+				continue;
+			}
+			break;
+		case ' ': case '\t': case '\f': case '\v': case '\r':
+			continue;
+		case '#':
+			if (!bol)
+				break;
+			s->pos = p;
+			s->chr = '#';
+			s->loc.col = p - line;
+			return;
+		case '/':
+			if (p == end)
+				break;
+			if (*p == '*') {
+				for (++p; p != end && (*p != '/' || p[-1] != '*' || p[-2] == '/'); ++p) {
+					if (*p == '\n')
+						++s->loc.line, line = p + 1;
+				}
+				if (p != end)
+					++p;
+				continue;
+			}
+			if (*p == '/') {
+				for (; p != end && *p != '\n'; ++p) {
+					if (*p == '\\' && p + 1 != end && p[1] == '\n')
+						++p, ++s->loc.line, line = p + 1;
+				}
+				continue;
+			}
+			break;
+		case '"':
+		case '\'':
+			q = p[-1];
+			for (; p != end && *p != q && *p != '\n'; ++p) {
+				if (*p == '\\' && p + 1 != end) {
+					if (*++p == '\n')
+						++s->loc.line, line = p + 1;
+				}
+			}
+			if (p != end && *p == q)
+				++p;
+			break;
+		}
+		bol = false;
+	}
+	s->pos = end;
+	s->chr = EOF;
+	s->loc.col = p - line + 1;
+}
+
+void
 scanclose(void)
 {
-	fclose(scanner->file);
-	free(scanner->buf.str);
-	free(scanner);
+	struct scanner *s;
+
+	s = scanner;
+	freedata(s);
+	free(s->buf.str);
+	free(s->ident);
+	free(s->cache);
+	scanner = s->next;
+	free(s);
+}
+
+/* return the next token from the token cache */
+static void
+replay(struct scanner *s, struct token *t)
+{
+	const struct cachedtoken *c;
+
+	c = s->token;
+	/* a header name is only used by scanheadername() */
+	if (c->kind == TNONE)
+		++c;
+	t->kind = c->kind;
+	t->loc.file = s->loc.file;
+	t->loc.line = c->line + s->linedelta;
+	t->loc.col = c->col;
+	if (c->kind == TIDENT)
+		t->lit = s->ident[c->lit];
+	else if (c->lit)
+		t->lit = textcopy(s->text + c->lit - 1, strlen(s->text + c->lit - 1) + 1);
+	else
+		t->lit = NULL;
+	/* as with scanskip() on the input itself, whitespace before the next token is not seen */
+	t->space = c->space && !s->skipped;
+	t->hide = false;
+	s->skipped = false;
+	if (c->kind != TEOF)
+		s->token = c + 1;
 }
 
 void
 scan(struct token *t)
 {
+	if (scanner->token) {
+		replay(scanner, t);
+		goto done;
+	}
 	scanner->sawspace = false;
 	for (;;) {
 		t->kind = scankind(scanner, &t->loc);
-		if (t->kind != TEOF || !scanner->next)
+		if (t->kind != TEOF || !scanner->next || scanner->include)
 			break;
 		scanclose();
-		scanner = scanner->next;
 		scanopen();
 	}
-	if (scanner->usebuf) {
+	if (t->kind == TIDENT) {
+		t->lit = intern((char *)scanner->buf.str, scanner->buf.len);
+		scanner->buf.len = 0;
+		scanner->usebuf = false;
+	} else if (scanner->usebuf) {
 		t->lit = bufget(&scanner->buf);
 		scanner->usebuf = false;
 	} else {
@@ -472,4 +1237,7 @@ scan(struct token *t)
 	}
 	t->space = scanner->sawspace;
 	t->hide = false;
+done:
+	if (includereport && t->kind != TNEWLINE && t->kind != TEOF)
+		reportadd(REPORTTOKENS, 1);
 }
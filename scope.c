@@ -4,8 +4,30 @@
 #include "util.h"
 #include "cc.h"
 
+/*
+All scopes share a single table of names. Each name has a list of the
+bindings of its identifier and of its tag, innermost scope first, so
+finding a declaration does not depend on how deeply its scope is
+nested. A scope records the bindings declared in it, and removes them
+again when it is deleted.
+
+The scopes with bindings are normally nested in one another. The
+exception is the parameter scope of a function declarator, which is
+kept until the end of the declarator in case it is re-opened for the
+function body. In the meantime it is hidden, and other scopes may be
+opened beside it at the same depth, so bindings belong to a scope by
+identity rather than by depth.
+*/
+
+struct name {
+	struct binding *decl, *tag;
+};
+
 struct scope filescope;
 
+static struct map names;
+static struct binding *freebindings;
+
 void
 scopeinit(void)
 {
@@ -26,22 +48,54 @@ scopeinit(void)
 	static struct decl valist;
 	struct decl *d;
 
-	for (d = builtins; d < builtins + LEN(builtins); ++d)
+	if (!names.cap)
+		mapinit(&names, 1024);
+	for (d = builtins; d < builtins + LEN(builtins); ++d) {
+		d->name = intern(d->name, strlen(d->name));
 		scopeputdecl(&filescope, d);
-	valist.name = "__builtin_va_list";
+	}
+	valist.name = intern("__builtin_va_list", 17);
 	valist.kind = DECLTYPE;
 	valist.type = targ->typevalist;
 	scopeputdecl(&filescope, &valist);
 }
 
+static void
+unbind(struct binding *b)
+{
+	struct binding **p, *next;
+
+	for (; b; b = next) {
+		next = b->next;
+		for (p = b->head; *p != b; p = &(*p)->shadow)
+			;
+		*p = b->shadow;
+		b->next = freebindings;
+		freebindings = b;
+	}
+}
+
+/* remove all file scope declarations and tags, leaving only the builtins */
+void
+scopereset(void)
+{
+	unbind(filescope.decls);
+	unbind(filescope.tags);
+	filescope.decls = NULL;
+	filescope.tags = NULL;
+	scopeinit();
+}
+
 struct scope *
 mkscope(struct scope *parent)
 {
 	struct scope *s;
 
 	s = xmalloc(sizeof(*s));
-	s->decls.len = 0;
-	s->tags.len = 0;
+	s->decls = NULL;
+	s->tags = NULL;
+	s->depth = parent->depth + 1;
+	s->hidden = false;
 	s->breaklabel = parent->breaklabel;
 	s->continuelabel = parent->continuelabel;
 	s->switchcases = parent->switchcases;
@@ -55,63 +109,96 @@ delscope(struct scope *s)
 {
 	struct scope *parent = s->parent;
 
-	if (s->decls.len)
-		mapfree(&s->decls, NULL);
-	if (s->tags.len)
-		mapfree(&s->tags, NULL);
+	unbind(s->decls);
+	unbind(s->tags);
 	free(s);
 
 	return parent;
 }
 
+static struct binding *
+lookup(struct binding *b, struct scope *s, bool recurse)
+{
+	while (b && (b->depth > s->depth || b->scope->hidden))
+		b = b->shadow;
+	if (b && !recurse && b->scope != s)
+		b = NULL;
+	return b;
+}
+
+/* find or add the binding of name in scope s */
+static struct binding *
+bind(struct scope *s, const char *name, bool tag)
+{
+	struct binding **head, **p, *b, **log;
+	struct name **n;
+	struct mapkey k;
+
+	internkey(&k, name);
+	n = (struct name **)mapput(&names, &k);
+	if (!*n) {
+		*n = xmalloc(sizeof(**n));
+		(*n)->decl = NULL;
+		(*n)->tag = NULL;
+	}
+	head = tag ? &(*n)->tag : &(*n)->decl;
+	/* bindings of scopes beside s at the same depth are kept ahead of it */
+	for (p = head; (b = *p) && (b->depth > s->depth || b->depth == s->depth && b->scope != s); p = &b->shadow)
+		;
+	if (b && b->scope == s)
+		return b;
+	if (freebindings) {
+		b = freebindings;
+		freebindings = b->next;
+	} else {
+		b = xmalloc(sizeof(*b));
+	}
+	b->name = name;
+	b->scope = s;
+	b->depth = s->depth;
+	b->shadow = *p;
+	b->head = head;
+	*p = b;
+	log = tag ? &s->tags : &s->decls;
+	b->next = *log;
+	*log = b;
+	return b;
+}
+
 struct decl *
 scopegetdecl(struct scope *s, const char *name, bool recurse)
 {
-	struct decl *d;
 	struct mapkey k;
+	struct name *n;
+	struct binding *b;
 
-	mapkey(&k, name, strlen(name));
-	do {
-		d = s->decls.len ? mapget(&s->decls, &k) : NULL;
-		s = s->parent;
-	} while (!d && s && recurse);
-
-	return d;
+	internkey(&k, name);
+	n = mapget(&names, &k);
+	b = n ? lookup(n->decl, s, recurse) : NULL;
+	return b ? b->u.decl : NULL;
 }
 
 struct type *
 scopegettag(struct scope *s, const char *name, bool recurse)
 {
-	struct type *t;
 	struct mapkey k;
+	struct name *n;
+	struct binding *b;
 
-	mapkey(&k, name, strlen(name));
-	do {
-		t = s->tags.len ? mapget(&s->tags, &k) : NULL;
-		s = s->parent;
-	} while (!t && s && recurse);
-
-	return t;
+	internkey(&k, name);
+	n = mapget(&names, &k);
+	b = n ? lookup(n->tag, s, recurse) : NULL;
+	return b ? b->u.tag : NULL;
 }
 
 void
 scopeputdecl(struct scope *s, struct decl *d)
 {
-	struct mapkey k;
-
-	if (!s->decls.len)
-		mapinit(&s->decls, 32);
-	mapkey(&k, d->name, strlen(d->name));
-	*mapput(&s->decls, &k) = d;
+	bind(s, d->name, false)->u.decl = d;
 }
 
 void
 scopeputtag(struct scope *s, const char *name, struct type *t)
 {
-	struct mapkey k;
-
-	if (!s->tags.len)
-		mapinit(&s->tags, 32);
-	mapkey(&k, name, strlen(name));
-	*mapput(&s->tags, &k) = t;
+	bind(s, name, true)->u.tag = t;
 }
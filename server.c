@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "cc.h"
+
+/* receive the input, output and error descriptors of a job */
+static bool
+recvfds(int sock, int fd[3])
+{
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	char c;
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(sock, &msg, 0) != 1)
+		return false;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return false;
+	memcpy(fd, CMSG_DATA(cmsg), 3 * sizeof(int));
+	return true;
+}
+
+/*
+Listen for jobs on the UNIX socket at path. Each connection passes
+the input, output and error descriptors of a job; it is compiled by a
+process forked from the already initialized server, and the wait
+status of that process is written back to the connection.
+
+This function only returns in a job process, with the job's input,
+output and diagnostics on standard input, output and error.
+*/
+void
+serve(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock, conn, fd[3], i, status;
+	pid_t pid;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fatal("socket path '%s' is too long", path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		fatal("socket:");
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("bind %s:", path);
+	if (listen(sock, SOMAXCONN) < 0)
+		fatal("listen:");
+	/* let the system reap job processes */
+	signal(SIGCHLD, SIG_IGN);
+	for (;;) {
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fatal("accept:");
+		}
+		pid = fork();
+		if (pid == 0)
+			break;
+		if (pid < 0)
+			warn("fork:");
+		close(conn);
+	}
+
+	/* job process */
+	close(sock);
+	signal(SIGCHLD, SIG_DFL);
+	if (!recvfds(conn, fd))
+		fatal("failed to receive job descriptors");
+	pid = fork();
+	if (pid == 0) {
+		close(conn);
+		if (dup2(fd[0], 0) < 0 || dup2(fd[1], 1) < 0 || dup2(fd[2], 2) < 0)
+			fatal("dup2:");
+		for (i = 0; i < 3; ++i) {
+			if (fd[i] > 2)
+				close(fd[i]);
+		}
+		return;
+	}
+	for (i = 0; i < 3; ++i)
+		close(fd[i]);
+	if (pid < 0)
+		fatal("fork:");
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			fatal("waitpid:");
+	}
+	if (write(conn, &status, sizeof(status)) != sizeof(status))
+		fatal("write:");
+	exit(0);
+}
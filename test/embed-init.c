@@ -0,0 +1,15 @@
+char s[] = {
+#embed "embed-init.txt"
+};
+unsigned char t[8] = {
+#embed "embed-init.txt" limit(3) suffix(, 0)
+};
+struct {
+	char a[2];
+	int b;
+} u = {
+#embed "embed-init.txt" limit(3)
+};
+int w[] = {
+#embed "embed-init.txt" limit(2)
+};
@@ -0,0 +1,3 @@
+typedef int T;
+int (*f(int T))(T x);
+int (*g(int a))(double a) { return (int (*)(double))(long)sizeof(a); }
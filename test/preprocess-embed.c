@@ -0,0 +1,4 @@
+#embed "preprocess-embed.txt"
+#define LIMIT 2
+#embed "preprocess-embed.txt" limit(LIMIT) prefix(x = {) suffix(};)
+#embed "preprocess-embed.txt" limit(0) prefix(x) if_empty(empty)
@@ -0,0 +1,3 @@
+101,109,98,101,100,10
+x = {101,109};
+empty
@@ -0,0 +1,25 @@
+#define ONE 1
+#define INC(x) ((x) + 1)
+#if ONE
+a
+#elif 1 / 0
+b
+#endif
+#if INC(ONE) == 2 && -1 < 0 && !(-1 < 0u) && 'a' == 97 && (0 ? 1 / 0 : 1)
+c
+#else
+d
+#endif
+#if 0
+#if garbage ((
+#else
+#endif
+'#endif
+e
+#elif undefined || 0x10 >> 5
+f
+#elif 1
+g
+#else
+h
+#endif
@@ -0,0 +1,3 @@
+a
+c
+g
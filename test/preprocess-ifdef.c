@@ -0,0 +1,18 @@
+#define A
+#ifdef A
+a
+#endif
+#ifndef A
+b
+#else
+c
+#endif
+#if defined A && defined(A) && !defined B
+d
+#endif
+#undef A
+#ifdef A
+e
+#elif !defined(A)
+f
+#endif
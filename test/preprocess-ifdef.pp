@@ -0,0 +1,4 @@
+a
+c
+d
+f
@@ -0,0 +1,7 @@
+#include "preprocess-include.h"
+#include "preprocess-include.h"
+#include "preprocess-include-once.h"
+#define ONCE "preprocess-include-once.h"
+#include ONCE
+#undef PREPROCESS_INCLUDE_H
+#include "preprocess-include.h"
@@ -0,0 +1,4 @@
+#ifndef PREPROCESS_INCLUDE_H
+#define PREPROCESS_INCLUDE_H
+guarded
+#endif
@@ -0,0 +1,3 @@
+guarded
+once
+guarded
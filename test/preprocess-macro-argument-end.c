@@ -0,0 +1,9 @@
+#define f(x) g(x
+#define g(x) x)
+f(f)(1))
+#define h(x) x
+#define k(x) [x]
+h(k(h(k)(1)))
+h(k)(2)
+h(k(2)
+)
@@ -0,0 +1,4 @@
+f(1))
+[[1]]
+[2]
+[2]
@@ -1,2 +1,5 @@
 #define foo foo bar
 foo
+#define N M
+#define M N
+N M
@@ -1 +1,2 @@
 foo bar
+N M
@@ -0,0 +1,12 @@
+#define cat(a, b) a ## b
+#define xcat(a, b) cat(a, b)
+#define id(x) x
+#define str(x) #x
+#define err(fmt, ...) f(fmt, ## __VA_ARGS__)
+#define list(args...) {args}
+cat(x, y) cat(, y) cat(x, ) cat(, ) cat(1.5, e3) cat(<, <=)
+xcat(cat(a, b), c) cat(id, )(1)
+err("a") err("a", 1, 2)
+list() list(1, 2)
+str(id(1)) id(str(id(1)))
+__LINE__ str(__LINE__) xcat(L, __LINE__)
@@ -0,0 +1,6 @@
+xy y x 1.5e3 <<=
+abc 1
+f("a") f("a", 1, 2)
+{} {1, 2}
+"id(1)" "id(1)"
+12 "__LINE__" L12
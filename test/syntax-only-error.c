@@ -0,0 +1,3 @@
+int y;
+int *p = &y + 1;
+long q = (long)&y * 2;
@@ -0,0 +1,17 @@
+static int counter;
+int table[] = {1, 2, 3};
+const char *name = "syntax-only";
+int *next = &table[1];
+
+int
+f(int x)
+{
+	static const char msg[] = "checked, not emitted";
+
+	switch (x) {
+	case 0: return msg[0];
+	default: goto out;
+	}
+out:
+	return counter + (int)sizeof(__func__);
+}
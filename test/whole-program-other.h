@@ -0,0 +1,4 @@
+/* the second translation unit of whole-program.c */
+static int used(int x) { return x * 2; }
+static int unused(int x) { return x; }
+int helper(void) { return used(3); }
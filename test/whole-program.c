@@ -0,0 +1,5 @@
+static int used(int x) { return x + 1; }
+static int unused(int x) { return x; }
+int unreachable(void) { return 2; }
+static int counter;
+int main(void) { return used(counter); }
@@ -0,0 +1,191 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "cc.h"
+
+/*
+The token cache holds the scanned tokens of included files, so that
+they do not need to be scanned again by later translation units. Each
+file has an entry named by the hash of its path, which is only used if
+the path, modification time, size and contents of the file all match.
+The entry is mapped into memory as is; its layout after the header and
+path is up to the scanner.
+*/
+
+#define MAGIC "cproctok"
+#define VERSION 2
+
+struct header {
+	char magic[8];
+	unsigned long long version;
+	unsigned long long mtime, size, hash;
+	unsigned long long pathlen, len;
+};
+
+/* an entry mapped by tokcacheget */
+struct entry {
+	const struct header *hdr;
+	size_t len;
+};
+
+const char *tokcachedir;
+static struct map entries;
+
+static char *
+entrypath(const char *path, const char *name)
+{
+	char *buf;
+	size_t len;
+
+	len = strlen(tokcachedir);
+	buf = xmalloc(len + 22);
+	memcpy(buf, tokcachedir, len);
+	if (name)
+		sprintf(buf + len, "/%s", name);
+	else
+		sprintf(buf + len, "/%016llx.tok", fnv1a(FNV1ABASIS, path, strlen(path)));
+	return buf;
+}
+
+/* check that an entry is for the given file */
+static bool
+valid(const struct header *h, size_t len, const char *path, const struct stat *st, const void *data, size_t size)
+{
+	size_t pathlen;
+
+	pathlen = strlen(path);
+	return len >= sizeof(*h)
+		&& memcmp(h->magic, MAGIC, sizeof(h->magic)) == 0
+		&& h->version == VERSION
+		&& h->pathlen == pathlen
+		&& len - sizeof(*h) >= ALIGNUP(pathlen, 8)
+		&& len - sizeof(*h) - ALIGNUP(pathlen, 8) == h->len
+		&& memcmp(h + 1, path, pathlen) == 0
+		&& h->mtime == (unsigned long long)st->st_mtime
+		&& h->size == size
+		&& (unsigned long long)st->st_size == size
+		&& h->hash == fnv1a(FNV1ABASIS, data, size);
+}
+
+/*
+Look up the cached tokens of the file at path, which has the given
+contents. The entry stays mapped for later translation units.
+*/
+const void *
+tokcacheget(const char *path, const void *data, size_t size, size_t *len)
+{
+	struct mapkey k;
+	struct entry *e, **slot;
+	struct stat st, est;
+	char *name;
+	void *map;
+	int fd;
+
+	if (!tokcachedir || stat(path, &st) < 0)
+		return NULL;
+	if (!entries.cap)
+		mapinit(&entries, 64);
+	mapkey(&k, path, strlen(path));
+	e = mapget(&entries, &k);
+	if (!e || !valid(e->hdr, e->len, path, &st, data, size)) {
+		name = entrypath(path, NULL);
+		fd = open(name, O_RDONLY);
+		free(name);
+		if (fd < 0)
+			return NULL;
+		map = MAP_FAILED;
+		if (fstat(fd, &est) == 0 && est.st_size > 0)
+			map = mmap(NULL, est.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return NULL;
+		if (!valid(map, est.st_size, path, &st, data, size)) {
+			munmap(map, est.st_size);
+			return NULL;
+		}
+		if (e) {
+			munmap((void *)e->hdr, e->len);
+		} else {
+			e = xmalloc(sizeof(*e));
+			k.str = xmalloc(k.len + 1);
+			memcpy((char *)k.str, path, k.len + 1);
+			slot = (struct entry **)mapput(&entries, &k);
+			*slot = e;
+		}
+		e->hdr = map;
+		e->len = est.st_size;
+	}
+	*len = e->hdr->len;
+	return (const char *)(e->hdr + 1) + ALIGNUP(e->hdr->pathlen, 8);
+}
+
+/* add the tokens of the file at path, which has the given contents, to the cache */
+void
+tokcacheput(const char *path, const void *data, size_t size, const void *tokens, size_t len)
+{
+	static const char pad[8];
+	struct header h;
+	struct stat st;
+	char *tmp, *name;
+	mode_t mask;
+	FILE *f;
+	int fd;
+	bool ret;
+
+	if (!tokcachedir || stat(path, &st) < 0)
+		return;
+	if (mkdir(tokcachedir, 0777) < 0 && errno != EEXIST) {
+		warn("mkdir %s:", tokcachedir);
+		return;
+	}
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.mtime = st.st_mtime;
+	h.size = size;
+	h.hash = fnv1a(FNV1ABASIS, data, size);
+	h.pathlen = strlen(path);
+	h.len = len;
+	/* write to a temporary file and rename it into place, so
+	 * that concurrent compiles never see a partial entry */
+	tmp = entrypath(path, "tmp.XXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		warn("mkstemp:");
+		free(tmp);
+		return;
+	}
+	/* mkstemp creates the file with mode 0600, but the cache may be shared */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	f = fdopen(fd, "w");
+	if (f) {
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(path, 1, h.pathlen, f);
+		fwrite(pad, 1, ALIGNUP(h.pathlen, 8) - h.pathlen, f);
+		fwrite(tokens, 1, len, f);
+		ret = !ferror(f);
+		if (fclose(f) != 0)
+			ret = false;
+	} else {
+		close(fd);
+		ret = false;
+	}
+	name = entrypath(path, NULL);
+	if (!ret || rename(tmp, name) < 0) {
+		warn("cache tokens of %s:", path);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(name);
+}
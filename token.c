@@ -1,9 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
 #include "util.h"
 #include "cc.h"
 
@@ -120,13 +126,66 @@ const char *tokstr[] = {
 	[THASHHASH] = "##",
 };
 
+/*
+Preprocessed output is collected in a large buffer and written in
+blocks with write(), rather than going through stdio for every token.
+Nothing else writes to stdout while preprocessing, so stdio's buffer
+is always empty.
+*/
+static struct {
+	char buf[1<<16];
+	size_t len;
+} out;
+
+static void
+writeall(const char *str, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fileno(stdout), str, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("write:");
+		}
+		str += n;
+		len -= n;
+	}
+}
+
+static void
+outwrite(const char *str, size_t len)
+{
+	if (len > sizeof(out.buf) - out.len) {
+		tokenflush();
+		if (len > sizeof(out.buf)) {
+			writeall(str, len);
+			return;
+		}
+	}
+	memcpy(out.buf + out.len, str, len);
+	out.len += len;
+}
+
+/* write the tokens printed so far to stdout */
+void
+tokenflush(void)
+{
+	writeall(out.buf, out.len);
+	out.len = 0;
+}
+
 void
 tokenprint(const struct token *t)
 {
 	const char *str;
 
-	if (t->space)
-		fputc(' ', stdout);
+	if (t->space) {
+		if (out.len == sizeof(out.buf))
+			tokenflush();
+		out.buf[out.len++] = ' ';
+	}
 	switch (t->kind) {
 	case TIDENT:
 	case TNUMBER:
@@ -144,7 +203,7 @@ tokenprint(const struct token *t)
 	}
 	if (!str)
 		fatal("cannot print token %d", t->kind);
-	fputs(str, stdout);
+	outwrite(str, strlen(str));
 }
 
 static void
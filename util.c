@@ -87,6 +87,33 @@ progname(char *name, char *fallback)
 	return slash ? slash + 1 : name;
 }
 
+/* print s to stderr as a JSON string */
+void
+jsonstr(const char *s)
+{
+	putc('"', stderr);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(stderr, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(stderr, "\\u%04x", *s);
+		else
+			putc(*s, stderr);
+	}
+	putc('"', stderr);
+}
+
+/* continue the 64-bit FNV-1a hash h over len bytes at ptr */
+unsigned long long
+fnv1a(unsigned long long h, const void *ptr, size_t len)
+{
+	const unsigned char *pos, *end;
+
+	for (pos = ptr, end = pos + len; pos != end; ++pos)
+		h = (h ^ *pos) * 0x100000001b3;
+	return h;
+}
+
 void *
 arrayadd(struct array *a, size_t n)
 {
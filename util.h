@@ -28,6 +28,11 @@ void *xreallocarray(void *, size_t, size_t);
 void *xmalloc(size_t);
 
 char *progname(char *, char *);
+void jsonstr(const char *);
+
+/* the initial value of a 64-bit FNV-1a hash */
+#define FNV1ABASIS 0xcbf29ce484222325
+unsigned long long fnv1a(unsigned long long, const void *, size_t);
 
 void listinsert(struct list *, struct list *);
 void listremove(struct list *);
@@ -59,6 +64,10 @@ void mapfree(struct map *, void(void *));
 void **mapput(struct map *, struct mapkey *);
 void *mapget(struct map *, struct mapkey *);
 
+char *intern(const char *, size_t);
+void internkey(struct mapkey *, const char *);
+int *internval(const char *);
+
 /* tree */
 
 void *treeinsert(void **, unsigned long long, size_t);